@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# Hammers the iPodUSB playback trigger/hw_params/hw_free paths while a dock
+# is attached and streaming: aplay is started with a random buffer geometry
+# and killed after a random time, either with SIGINT (trigger stop, drop,
+# hw_free) or SIGKILL (straight to close). Fails if the kernel logged a
+# warning or oops, or the driver had to dequeue requests still in flight.
+#
+#   sudo ./audio_stress.sh [iterations] [rate]
+
+ITERATIONS=${1:-1000}
+RATE=${2:-44100}
+DEVICE="hw:CARD=iPodUSB,DEV=0"
+STATS=$(ls /sys/kernel/debug/ipod_audio/card*/stats 2>/dev/null | head -n 1)
+
+if [[ $EUID > 0 ]]; then
+    echo "$0 is not running as root. Try using sudo."
+    exit 2
+fi
+
+if ! aplay -L | grep -q "CARD=iPodUSB"; then
+    echo "Error: no iPodUSB card, load g_ipod_audio and connect the dock first."
+    exit 1
+fi
+
+# only look at what the kernel logs from here on
+DMESG_START=$(dmesg | wc -l)
+
+PERIODS=(256 441 480 1024)
+for ((i = 1; i <= ITERATIONS; i++)); do
+    PERIOD=${PERIODS[$((RANDOM % ${#PERIODS[@]}))]}
+    BUFFER=$((PERIOD * (4 + RANDOM % 5)))
+
+    aplay -q -D "$DEVICE" -t raw -f S16_LE -c 2 -r "$RATE" \
+        --period-size="$PERIOD" --buffer-size="$BUFFER" /dev/zero 2>/dev/null &
+    APLAY=$!
+
+    # from before the first period elapses to a couple of seconds in
+    sleep "$((RANDOM % 3)).$((RANDOM % 1000))"
+
+    if ((RANDOM % 2)); then
+        kill -INT "$APLAY" 2>/dev/null
+    else
+        kill -KILL "$APLAY" 2>/dev/null
+    fi
+    wait "$APLAY" 2>/dev/null
+
+    if ((i % 50 == 0)); then
+        echo "$i/$ITERATIONS"
+    fi
+done
+
+if [[ -n "$STATS" ]]; then
+    echo ""
+    cat "$STATS"
+fi
+
+echo ""
+if dmesg | tail -n +"$((DMESG_START + 1))" | \
+    grep -E "WARNING|BUG|Oops|still in flight|usb_ep_queue error"; then
+    echo "FAILED: see the kernel log lines above."
+    exit 1
+fi
+echo "OK: $ITERATIONS start/stop cycles at $RATE Hz."
@@ -809,8 +809,8 @@ int ipod_hid_bind(struct usb_configuration *conf, struct usb_function *func)
 
 	DBG(conf->cdev, " = %s() \n", __FUNCTION__);
 	usb_interface_id(conf, func);
-	func->fs_descriptors = ipod_hid_desc_fs_hs;
-	func->hs_descriptors = ipod_hid_desc_fs_hs;
+	func->fs_descriptors = ipod_hid_desc_fs;
+	func->hs_descriptors = ipod_hid_desc_fs;
 
 	spin_lock_init(&ipod_hid_data.read_lock);
 	spin_lock_init(&ipod_hid_data.write_lock);
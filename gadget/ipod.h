@@ -1,6 +1,10 @@
 #define IPOD_USB_VENDOR 0x05ac
 #define IPOD_USB_PRODUCT 0x1297
 
+// 1 ms of 48 kHz 16 bit stereo plus one frame, so a cadence running a few
+// ppm fast still fits a packet (f_uac1 sizes its endpoint the same way)
+#define IPOD_AUDIO_MAX_PACKET_SIZE ((48 + 1) * 2 * 2)
+
 static struct usb_string strings_dev[] = {
 	[USB_GADGET_MANUFACTURER_IDX].s = "",
 	[USB_GADGET_PRODUCT_IDX].s = "",
@@ -131,7 +135,7 @@ static struct usb_endpoint_descriptor ipod_audio_stream_1_endpoint_fs = {
 	.bDescriptorType =	USB_DT_ENDPOINT  ,
 	.bEndpointAddress =  USB_DIR_IN ,
 	.bmAttributes =	USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_SYNC_NONE,
-	.wMaxPacketSize =	cpu_to_le16(192),
+	.wMaxPacketSize =	cpu_to_le16(IPOD_AUDIO_MAX_PACKET_SIZE),
 	.bInterval =	1,
 	.bRefresh =	0,
 	.bSynchAddress = 0
@@ -142,7 +146,7 @@ static struct usb_endpoint_descriptor ipod_audio_stream_1_endpoint_hs = {
 	.bDescriptorType =	USB_DT_ENDPOINT  ,
 	.bEndpointAddress =  USB_DIR_IN ,
 	.bmAttributes =	USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_SYNC_NONE,
-	.wMaxPacketSize =	cpu_to_le16(192),
+	.wMaxPacketSize =	cpu_to_le16(IPOD_AUDIO_MAX_PACKET_SIZE),
 	.bInterval =	4,
 	.bRefresh =	0,
 	.bSynchAddress = 0
@@ -204,26 +208,27 @@ static struct usb_interface_descriptor ipod_hid_desc = {
 	/* .iInterface		= DYNAMIC */
 };
 
-// static unsigned char ipod_hid_report[] = {
-//   0x06, 0x00, 0xff, 0x09, 0x01, 0xa1, 0x01, 0x75, 0x08, 0x26, 0x80, 0x00,
-//   0x15, 0x00, 0x09, 0x01, 0x85, 0x01, 0x95, 0x05, 0x82, 0x02, 0x01, 0x09,
-//   0x01, 0x85, 0x02, 0x95, 0x09, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x03,
-//   0x95, 0x0d, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x04, 0x95, 0x11, 0x82,
-//   0x02, 0x01, 0x09, 0x01, 0x85, 0x05, 0x95, 0x19, 0x82, 0x02, 0x01, 0x09,
-//   0x01, 0x85, 0x06, 0x95, 0x31, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x07,
-//   0x95, 0x5f, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x08, 0x95, 0xc1, 0x82,
-//   0x02, 0x01, 0x09, 0x01, 0x85, 0x09, 0x96, 0x01, 0x01, 0x82, 0x02, 0x01,
-//   0x09, 0x01, 0x85, 0x0a, 0x96, 0x81, 0x01, 0x82, 0x02, 0x01, 0x09, 0x01,
-//   0x85, 0x0b, 0x96, 0x01, 0x02, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x0c,
-//   0x96, 0xff, 0x02, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x0d, 0x95, 0x05,
-//   0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x0e, 0x95, 0x09, 0x92, 0x02, 0x01,
-//   0x09, 0x01, 0x85, 0x0f, 0x95, 0x0d, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85,
-//   0x10, 0x95, 0x11, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x11, 0x95, 0x19,
-//   0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x12, 0x95, 0x31, 0x92, 0x02, 0x01,
-//   0x09, 0x01, 0x85, 0x13, 0x95, 0x5f, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85,
-//   0x14, 0x95, 0xc1, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x15, 0x95, 0xff,
-//   0x92, 0x02, 0x01, 0xc0
-// };
+// hid descriptor for usb high speed (same as a real iPod)
+static unsigned char ipod_hid_report_hs[] = {
+	0x06, 0x00, 0xff, 0x09, 0x01, 0xa1, 0x01, 0x75, 0x08, 0x26, 0x80, 0x00,
+	0x15, 0x00, 0x09, 0x01, 0x85, 0x01, 0x95, 0x05, 0x82, 0x02, 0x01, 0x09,
+	0x01, 0x85, 0x02, 0x95, 0x09, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x03,
+	0x95, 0x0d, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x04, 0x95, 0x11, 0x82,
+	0x02, 0x01, 0x09, 0x01, 0x85, 0x05, 0x95, 0x19, 0x82, 0x02, 0x01, 0x09,
+	0x01, 0x85, 0x06, 0x95, 0x31, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x07,
+	0x95, 0x5f, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x08, 0x95, 0xc1, 0x82,
+	0x02, 0x01, 0x09, 0x01, 0x85, 0x09, 0x96, 0x01, 0x01, 0x82, 0x02, 0x01,
+	0x09, 0x01, 0x85, 0x0a, 0x96, 0x81, 0x01, 0x82, 0x02, 0x01, 0x09, 0x01,
+	0x85, 0x0b, 0x96, 0x01, 0x02, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x0c,
+	0x96, 0xff, 0x02, 0x82, 0x02, 0x01, 0x09, 0x01, 0x85, 0x0d, 0x95, 0x05,
+	0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x0e, 0x95, 0x09, 0x92, 0x02, 0x01,
+	0x09, 0x01, 0x85, 0x0f, 0x95, 0x0d, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85,
+	0x10, 0x95, 0x11, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x11, 0x95, 0x19,
+	0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x12, 0x95, 0x31, 0x92, 0x02, 0x01,
+	0x09, 0x01, 0x85, 0x13, 0x95, 0x5f, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85,
+	0x14, 0x95, 0xc1, 0x92, 0x02, 0x01, 0x09, 0x01, 0x85, 0x15, 0x95, 0xff,
+	0x92, 0x02, 0x01, 0xc0
+};
 
 // correct hid descriptor  for usb full speed
 static unsigned char ipod_hid_report[] = {
@@ -237,6 +242,19 @@ static unsigned char ipod_hid_report[] = {
 	0x02, 0x01, 0x09, 0x01, 0x85, 0x09, 0x95, 0x3f, 0x92, 0x02, 0x01, 0xc0
 };
 
+static struct hid_descriptor ipod_hid_desc2_hs = {
+	.bLength =            9,
+	.bDescriptorType=    33,
+	.bcdHID= cpu_to_le16(0x0111),
+	.bCountryCode=             0,
+	.bNumDescriptors =      1,
+	.desc = {{
+		.bDescriptorType = 34,
+		.wDescriptorLength = cpu_to_le16(sizeof(ipod_hid_report_hs))
+	}
+	}
+};
+
 static struct hid_descriptor ipod_hid_desc2 = {
 	.bLength =            9,
 	.bDescriptorType=    33,
@@ -261,14 +279,32 @@ static struct usb_endpoint_descriptor ipod_hid_endpoint = {
 	.bInterval =	1,
 };
 
+// bInterval 1 is one microframe (125us) at high speed
+static struct usb_endpoint_descriptor ipod_hid_endpoint_hs = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT  ,
+	.bEndpointAddress =  USB_DIR_IN ,
+	.bmAttributes =	USB_ENDPOINT_XFER_INT,
+	.wMaxPacketSize =	cpu_to_le16(64),
+	.bInterval =	1,
+};
 
 
 
 
-static struct usb_descriptor_header *ipod_hid_desc_fs_hs[] = {
+
+static struct usb_descriptor_header *ipod_hid_desc_fs[] = {
 	(struct usb_descriptor_header *) &ipod_hid_desc,
 	(struct usb_descriptor_header *) &ipod_hid_desc2,
 	(struct usb_descriptor_header *) &ipod_hid_endpoint,
 
 	NULL
 };
+
+static struct usb_descriptor_header *ipod_hid_desc_hs[] = {
+	(struct usb_descriptor_header *) &ipod_hid_desc,
+	(struct usb_descriptor_header *) &ipod_hid_desc2_hs,
+	(struct usb_descriptor_header *) &ipod_hid_endpoint_hs,
+
+	NULL
+};
@@ -16,10 +16,20 @@
 #include <linux/types.h>
 #include <linux/poll.h>
 #include <linux/kfifo.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/hrtimer.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
+#include <sound/control.h>
 #include <linux/platform_device.h>
 
 
@@ -29,11 +39,124 @@
 
 #define MIN_PERIODS 4
 
+// defaults, both can be changed per instance through configfs
 #define NUM_USB_AUDIO_TRANSFERS 4
-#define MAX_USB_AUDIO_PACKET_SIZE 180
+#define USB_AUDIO_IRQ_INTERVAL 1
+#define MAX_USB_AUDIO_TRANSFERS 64
+#define MAX_USB_AUDIO_PACKET_SIZE IPOD_AUDIO_MAX_PACKET_SIZE
+
+// retry period for requests the UDC refused to take back
+#define USB_AUDIO_REARM_US 1000
+
+// log2 buckets of nanoseconds, the last one takes everything from ~1 s up
+#define AUDIO_HIST_BUCKETS 32
+
+// used until the host picks a rate with SET_CUR
+#define DEFAULT_SAMPLE_RATE 44100
+
+// drift servo: measurement window, convergence time and output limit
+#define DRIFT_WINDOW_SEC 10
+#define DRIFT_CONVERGE_SEC 30
+#define DRIFT_MAX_PPM 1000
 
 #include "ipod.h"
 
+#define CREATE_TRACE_POINTS
+#include "ipod_audio_trace.h"
+
+static bool zero_copy = false;
+module_param(zero_copy, bool, 0444);
+MODULE_PARM_DESC(zero_copy, "Send audio straight from the ALSA buffer (no bounce copy)");
+
+// ipod_audio/cardN/stats
+static struct dentry *ipod_audio_debugfs_root;
+
+struct ipod_audio;
+
+// completion statuses counted apart, anything else goes to OTHER
+enum {
+	AUDIO_ERR_XDEV,
+	AUDIO_ERR_OVERFLOW,
+	AUDIO_ERR_PROTO,
+	AUDIO_ERR_OTHER,
+	NR_AUDIO_ERR,
+};
+
+static const char * const ipod_audio_err_names[NR_AUDIO_ERR] = {
+	"EXDEV", "EOVERFLOW", "EPROTO", "other",
+};
+
+/*
+ * Per CPU so the completion handler only ever bumps its own cache line.
+ * debugfs adds them up on read.
+ */
+struct ipod_audio_stats {
+	u64 packets;
+	u64 bytes;
+	u64 silence;
+	u64 errors[NR_AUDIO_ERR];
+	u64 req_lost;
+	u64 req_recovered;
+	u64 periods;
+	u64 xruns;
+	// time between completions and time spent in one
+	u64 interval_hist[AUDIO_HIST_BUCKETS];
+	u64 exec_hist[AUDIO_HIST_BUCKETS];
+};
+
+/*
+ * Buffer of the configured substream. Published with RCU at hw_params and
+ * torn down at hw_free after a grace period, so the completion handler can
+ * use it without taking a lock.
+ */
+struct ipod_audio_stream {
+	struct snd_pcm_substream *ss;
+	unsigned char *dma_area;
+	size_t dma_bytes;
+	size_t period_size;
+};
+
+/*
+ * Packet size cadence for one rate/interval. Every packet carries base
+ * bytes, plus one more frame whenever the accumulator wraps, which keeps
+ * the long term rate exact without any division in the hot path.
+ */
+struct ipod_audio_cadence {
+	unsigned int base;
+	unsigned int step;
+	u32 frac;
+	u32 mod;
+};
+
+struct ipod_audio_req {
+	struct ipod_audio *audio;
+	struct usb_request *req;
+
+	// bounce buffer, used for silence and when a packet wraps the ring
+	void *buf;
+
+	// ring offset right after this packet and its length (0 for silence)
+	size_t ptr;
+	unsigned int len;
+	unsigned int run_state;
+	// req->buf points into dma_area
+	bool zero_copy;
+};
+
+struct ipod_audio_opts {
+	struct usb_function_instance fi;
+	struct mutex lock;
+	int refcnt;
+
+	unsigned int req_number;
+	unsigned int irq_interval;
+};
+
+// same order as ipod_audio_stream_1_uac_discrete.tSamFreq
+static const unsigned int ipod_audio_rates[] = {
+	8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000
+};
+
 struct ipod_audio {
     struct usb_function func;
     int ac_intf, ac_alt;
@@ -44,22 +167,87 @@ struct ipod_audio {
 	struct snd_card *card;
 	struct snd_pcm *pcm;
 
-	struct snd_pcm_substream *ss;
+	struct ipod_audio_stream __rcu *stream;
 
-	size_t dma_bytes;
-	unsigned char *dma_area;
-	size_t period_size;
+	// trigger generation << 1, bit 0 set while running. Written by trigger only.
+	unsigned int run_state;
 
+	// owned by the completion handler, reset when it sees a new run_state
 	ssize_t hw_ptr;
+	// zero copy: everything before this has left the UDC
+	ssize_t done_ptr;
+	// run_state hw_ptr belongs to
+	unsigned int hw_gen;
+	// audio bytes handed to the UDC and not completed yet
+	unsigned int queued_bytes;
 	void *rbuf;
 
+	// USB frame number of the last audio completion and bytes sent by then
+	seqcount_t ts_seq;
+	int ts_frame;
+	u64 ts_bytes;
+	struct usb_gadget *gadget;
+
+	// sample rate selected by the host, 0 if it never sent SET_CUR
+	unsigned int rate;
+	// rate the packets are sized for
+	unsigned int pkt_rate;
+
+	// cadence tables for full/high speed, built at bind
+	struct ipod_audio_cadence cadence[2][ARRAY_SIZE(ipod_audio_rates)];
+	struct ipod_audio_cadence *cad;
+	u32 cad_acc;
+	bool high_speed;
+	int ppm;
+
+	/*
+	 * Drift servo. The host consumes at its SOF rate, the app produces
+	 * at its own, the difference shows up as the ring fill level moving.
+	 * Fill is sampled every period against frames on the wire and summed
+	 * per half window, the slope between the two halves is the drift.
+	 */
+	u64 drift_start;
+	unsigned int drift_n[2];
+	s64 drift_sum_x[2];
+	s64 drift_sum_fill[2];
+	long drift_target;
+	bool drift_primed;
+	int drift_ppm;
+	int drift_corr;
+	struct snd_kcontrol *drift_kctl;
+	struct snd_kcontrol *corr_kctl;
+
+	// serializes writers of run_state/pkt_rate/cad, never taken on completion
 	spinlock_t play_lock;
 
+	atomic_t zc_inflight;
+	wait_queue_head_t zc_wait;
+
 	struct usb_ep *in_ep;
     bool in_ep_enabled;
-	struct usb_request **in_req;
-
-	int cnt;
+	struct ipod_audio_req *in_req;
+	// stop frees the requests under it, hw_free dequeues them under it;
+	// ep_gen counts stops so hw_free can tell its requests are gone
+	spinlock_t ep_lock;
+	unsigned int ep_gen;
+	// queue depth and how many requests share one completion interrupt
+	unsigned int req_number;
+	unsigned int irq_interval;
+
+	/*
+	 * Requests usb_ep_queue() refused. Whoever clears a bit owns that
+	 * request and queues it again, from the next completion or rearm_timer.
+	 */
+	DECLARE_BITMAP(req_lost_mask, MAX_USB_AUDIO_TRANSFERS);
+	struct hrtimer rearm_timer;
+	// requests the UDC holds right now
+	atomic_t req_inflight;
+
+	// since bind
+	struct ipod_audio_stats __percpu *stats;
+	// owned by the completion handler, 0 until the first one after start
+	u64 last_complete_ns;
+	struct dentry *debugfs;
 };
 
 static inline struct ipod_audio *func_to_ipod_audio(struct usb_function *f)
@@ -67,11 +255,231 @@ static inline struct ipod_audio *func_to_ipod_audio(struct usb_function *f)
 	return container_of(f, struct ipod_audio, func);
 }
 
+static const struct snd_pcm_hw_constraint_list ipod_audio_rate_list = {
+	.count = ARRAY_SIZE(ipod_audio_rates),
+	.list = ipod_audio_rates,
+};
+
+static bool ipod_audio_rate_valid(unsigned int rate)
+{
+	int i;
+	for (i = 0; i < ARRAY_SIZE(ipod_audio_rates); i++) {
+		if (ipod_audio_rates[i] == rate)
+			return true;
+	}
+	return false;
+}
+
+static u64 ipod_audio_gcd64(u64 a, u64 b)
+{
+	u64 r;
+	while (b) {
+		div64_u64_rem(a, b, &r);
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+/*
+ * frames per packet = rate * interval_us * (1e6 + ppm) / 1e12, kept as
+ * base + frac/mod so the remainder is never lost.
+ */
+static void ipod_audio_cadence_init(struct ipod_audio_cadence *cad,
+	unsigned int rate, unsigned int frame_bytes, unsigned int interval_us,
+	int ppm, unsigned int max_bytes)
+{
+	u64 num = (u64)rate * interval_us * (1000000 + ppm);
+	u64 den = 1000000ULL * 1000000ULL;
+	u64 g = ipod_audio_gcd64(num, den);
+	u64 frames, rem;
+
+	num = div64_u64(num, g);
+	den = div64_u64(den, g);
+	frames = div64_u64_rem(num, den, &rem);
+
+	// only happens for odd ppm values, a tiny loss of precision is fine
+	while (den > U32_MAX) {
+		den >>= 1;
+		rem >>= 1;
+	}
+
+	cad->base = frames * frame_bytes;
+	cad->step = frame_bytes;
+	cad->frac = rem;
+	cad->mod = den;
+
+	if (cad->base + (cad->frac ? cad->step : 0) > max_bytes) {
+		cad->base = rounddown(max_bytes, frame_bytes);
+		cad->frac = 0;
+		cad->mod = 1;
+	}
+}
+
+static unsigned int ipod_audio_interval_us(struct usb_endpoint_descriptor *desc, bool high_speed)
+{
+	unsigned int interval = 1 << (clamp_t(int, desc->bInterval, 1, 16) - 1);
+	return high_speed ? interval * 125 : interval * 1000;
+}
+
+static void ipod_audio_build_cadence(struct ipod_audio *audio, int ppm)
+{
+	unsigned int frame_bytes = ipod_audio_stream_1_uac_discrete.bSubframeSize
+		* ipod_audio_stream_1_uac_discrete.bNrChannels;
+	unsigned int fs_us = ipod_audio_interval_us(&ipod_audio_stream_1_endpoint_fs, false);
+	unsigned int hs_us = ipod_audio_interval_us(&ipod_audio_stream_1_endpoint_hs, true);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ipod_audio_rates); i++) {
+		ipod_audio_cadence_init(&audio->cadence[0][i], ipod_audio_rates[i],
+			frame_bytes, fs_us, ppm, MAX_USB_AUDIO_PACKET_SIZE);
+		ipod_audio_cadence_init(&audio->cadence[1][i], ipod_audio_rates[i],
+			frame_bytes, hs_us, ppm, MAX_USB_AUDIO_PACKET_SIZE);
+	}
+	audio->ppm = ppm;
+}
+
+// pick the table entry for the current wire rate and bus speed, play_lock held
+static void ipod_audio_select_cadence(struct ipod_audio *audio)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ipod_audio_rates); i++) {
+		if (ipod_audio_rates[i] == audio->pkt_rate) {
+			WRITE_ONCE(audio->cad, &audio->cadence[audio->high_speed][i]);
+			return;
+		}
+	}
+	WRITE_ONCE(audio->cad, NULL);
+}
+
+// start a new measurement window at the current wire position
+static void ipod_audio_drift_reset(struct ipod_audio *audio)
+{
+	audio->drift_start = audio->ts_bytes;
+	memset(audio->drift_n, 0, sizeof(audio->drift_n));
+	memset(audio->drift_sum_x, 0, sizeof(audio->drift_sum_x));
+	memset(audio->drift_sum_fill, 0, sizeof(audio->drift_sum_fill));
+}
+
+/*
+ * Called right after snd_pcm_period_elapsed(), so status->hw_ptr is what
+ * ipod_audio_pcm_pointer() just returned. Everything is measured against
+ * frames that left on the wire (ts_bytes), not against period boundaries,
+ * and the app's write chunks average out over the window. Irq context.
+ */
+static void ipod_audio_drift_update(struct ipod_audio *audio, struct ipod_audio_stream *st)
+{
+	struct snd_pcm_runtime *runtime = st->ss->runtime;
+	snd_pcm_uframes_t window = runtime->rate * DRIFT_WINDOW_SEC;
+	snd_pcm_uframes_t x;
+	s64 mean_x[2], mean_fill[2];
+	long fill;
+	int ppm, corr, i;
+
+	x = bytes_to_frames(runtime, audio->ts_bytes - audio->drift_start);
+
+	fill = runtime->control->appl_ptr - runtime->status->hw_ptr;
+	if (fill < 0)
+		fill += runtime->boundary;
+	// in copy mode hw_ptr is ahead of the wire by what the UDC holds
+	if (!zero_copy)
+		fill += bytes_to_frames(runtime, audio->queued_bytes);
+
+	i = x >= window / 2;
+	audio->drift_n[i]++;
+	audio->drift_sum_x[i] += x;
+	audio->drift_sum_fill[i] += fill;
+	if (x < window)
+		return;
+
+	if (!audio->drift_n[0] || !audio->drift_n[1]) {
+		ipod_audio_drift_reset(audio);
+		return;
+	}
+
+	// means scaled by 1024 to keep sub-frame resolution
+	for (i = 0; i < 2; i++) {
+		mean_x[i] = div_s64(audio->drift_sum_x[i] * 1024, audio->drift_n[i]);
+		mean_fill[i] = div_s64(audio->drift_sum_fill[i] * 1024, audio->drift_n[i]);
+	}
+	ipod_audio_drift_reset(audio);
+	if (mean_x[1] <= mean_x[0])
+		return;
+
+	// positive: the app writes faster than the host reads
+	ppm = div64_s64((mean_fill[1] - mean_fill[0]) * 1000000, mean_x[1] - mean_x[0]);
+	fill = div_s64(mean_fill[1], 1024);
+
+	if (!audio->drift_primed) {
+		audio->drift_primed = true;
+		audio->drift_target = div_s64(mean_fill[0], 1024);
+		audio->drift_ppm = ppm;
+	} else {
+		audio->drift_ppm += (ppm - audio->drift_ppm) / 4;
+	}
+
+	// cancel the drift and pull the fill level back to where it started
+	corr = -audio->drift_ppm - div_s64((s64)(fill - audio->drift_target) * 1000000,
+		runtime->rate * DRIFT_CONVERGE_SEC);
+	corr = clamp(corr, -DRIFT_MAX_PPM, DRIFT_MAX_PPM);
+
+	if (corr != audio->drift_corr) {
+		audio->drift_corr = corr;
+		if (audio->corr_kctl)
+			snd_ctl_notify(audio->card, SNDRV_CTL_EVENT_MASK_VALUE, &audio->corr_kctl->id);
+	}
+	if (audio->drift_kctl)
+		snd_ctl_notify(audio->card, SNDRV_CTL_EVENT_MASK_VALUE, &audio->drift_kctl->id);
+}
+
+static int ipod_audio_ppm_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = -1000000;
+	uinfo->value.integer.max = 1000000;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int ipod_audio_drift_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct ipod_audio *audio = snd_kcontrol_chip(kcontrol);
+	ucontrol->value.integer.value[0] = READ_ONCE(audio->drift_ppm);
+	return 0;
+}
+
+static int ipod_audio_corr_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol)
+{
+	struct ipod_audio *audio = snd_kcontrol_chip(kcontrol);
+	ucontrol->value.integer.value[0] = READ_ONCE(audio->drift_corr);
+	return 0;
+}
+
+// measured drift of the app against the host, ppm
+static struct snd_kcontrol_new ipod_audio_drift_ctl = {
+	.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+	.name = "Playback Clock Drift",
+	.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info = ipod_audio_ppm_info,
+	.get = ipod_audio_drift_get,
+};
+
+// rate adjustment the app should apply to its resampler, ppm
+static struct snd_kcontrol_new ipod_audio_corr_ctl = {
+	.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+	.name = "Playback Rate Correction",
+	.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info = ipod_audio_ppm_info,
+	.get = ipod_audio_corr_get,
+};
+
 static struct snd_pcm_hardware ipod_audio_hw = {
 	.info = SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_BLOCK_TRANSFER | SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID | SNDRV_PCM_INFO_PAUSE | SNDRV_PCM_INFO_RESUME,
-	.rates = SNDRV_PCM_RATE_44100,
-	.rate_min = 44100,
-	.rate_max = 44100,
+	.rates = SNDRV_PCM_RATE_KNOT,
+	.rate_min = 8000,
+	.rate_max = 48000,
 	.buffer_bytes_max = BUFFER_BYTES_MAX,
 	//.period_bytes_max = PRD_SIZE_MAX,
 	//.period_bytes_min = MAX_USB_AUDIO_PACKET_SIZE,
@@ -90,15 +498,20 @@ static int ipod_audio_pcm_open(struct snd_pcm_substream *substream)
 	struct snd_pcm_runtime *runtime = substream->runtime;
 
 	runtime->hw = ipod_audio_hw;
-
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-	{
-		spin_lock_init(&audio->play_lock);
-		audio->cnt = 0;
-	}
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	runtime->hw.info |= SNDRV_PCM_INFO_HAS_LINK_ATIME;
+	#endif
 
 	snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
 
+	// the host decides, offer everything until it has
+	if (audio->rate)
+		snd_pcm_hw_constraint_minmax(runtime, SNDRV_PCM_HW_PARAM_RATE,
+			audio->rate, audio->rate);
+	else
+		snd_pcm_hw_constraint_list(runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
+			&ipod_audio_rate_list);
+
 	return 0;
 }
 
@@ -108,21 +521,89 @@ static int ipod_audio_pcm_close(struct snd_pcm_substream *substream)
 	return 0;
 }
 
+// unpublish the stream and wait until nothing can touch its buffer
+static void ipod_audio_req_lost(struct ipod_audio *audio, struct ipod_audio_req *ctx, int err);
+
+static void ipod_audio_stream_release(struct ipod_audio *audio)
+{
+	struct ipod_audio_stream *st = rcu_dereference_protected(audio->stream, true);
+	DECLARE_BITMAP(dequeued, MAX_USB_AUDIO_TRANSFERS);
+	struct ipod_audio_req *ctx;
+	unsigned long flags;
+	unsigned int i, gen;
+
+	if (!st)
+		return;
+
+	RCU_INIT_POINTER(audio->stream, NULL);
+	synchronize_rcu();
+
+	// zero copy requests may still be reading from the ring
+	if (wait_event_timeout(audio->zc_wait,
+			atomic_read(&audio->zc_inflight) == 0,
+			msecs_to_jiffies(100))) {
+		kfree(st);
+		return;
+	}
+
+	/*
+	 * The host stopped polling with packets queued. The UDC may not keep
+	 * pointing at the ring once ALSA frees it, so take them back and only
+	 * then let the ring go. The rearm timer queues them again as silence.
+	 */
+	pr_warn("hw_free: %d requests still in flight, dequeueing\n",
+		atomic_read(&audio->zc_inflight));
+	bitmap_zero(dequeued, MAX_USB_AUDIO_TRANSFERS);
+	spin_lock_irqsave(&audio->ep_lock, flags);
+	gen = audio->ep_gen;
+	for (i = 0; audio->in_ep_enabled && i < audio->req_number; i++) {
+		ctx = &audio->in_req[i];
+		if (READ_ONCE(ctx->zero_copy) && ctx->req &&
+			!usb_ep_dequeue(audio->in_ep, ctx->req))
+			set_bit(i, dequeued);
+	}
+	spin_unlock_irqrestore(&audio->ep_lock, flags);
+
+	if (!wait_event_timeout(audio->zc_wait,
+			atomic_read(&audio->zc_inflight) == 0,
+			msecs_to_jiffies(1000)))
+		pr_err("hw_free: UDC kept %d requests, freeing the ring under them\n",
+			atomic_read(&audio->zc_inflight));
+
+	// a stop in between freed the requests, a start made new ones
+	spin_lock_irqsave(&audio->ep_lock, flags);
+	if (audio->in_ep_enabled && audio->ep_gen == gen)
+		for_each_set_bit(i, dequeued, audio->req_number)
+			ipod_audio_req_lost(audio, &audio->in_req[i], -ECONNRESET);
+	spin_unlock_irqrestore(&audio->ep_lock, flags);
+
+	kfree(st);
+}
+
 static int ipod_audio_pcm_hw_params(struct snd_pcm_substream *substream,
 									struct snd_pcm_hw_params *hw_params)
 {
     struct ipod_audio *audio = snd_pcm_substream_chip(substream);
+	struct ipod_audio_stream *st;
 	int err = 0;
 
 	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
 	{
+		// malloc_pages may reallocate the ring under the old stream
+		ipod_audio_stream_release(audio);
+
 		err = snd_pcm_lib_malloc_pages(substream,
 									   params_buffer_bytes(hw_params));
 		if (err >= 0)
 		{
-			audio->dma_bytes = substream->runtime->dma_bytes;
-			audio->dma_area = substream->runtime->dma_area;
-			audio->period_size = params_period_bytes(hw_params);
+			st = kzalloc(sizeof(*st), GFP_KERNEL);
+			if (!st)
+				return -ENOMEM;
+			st->ss = substream;
+			st->dma_bytes = substream->runtime->dma_bytes;
+			st->dma_area = substream->runtime->dma_area;
+			st->period_size = params_period_bytes(hw_params);
+			rcu_assign_pointer(audio->stream, st);
 		}
 	}
 	return err;
@@ -132,11 +613,7 @@ static int ipod_audio_pcm_hw_free(struct snd_pcm_substream *substream)
 {
     struct ipod_audio *audio = snd_pcm_substream_chip(substream);
 	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-	{
-		audio->dma_bytes = 0;
-		audio->dma_area = NULL;
-		audio->period_size = 0;
-	}
+		ipod_audio_stream_release(audio);
 
 	return snd_pcm_lib_free_pages(substream);
 }
@@ -145,42 +622,132 @@ static int ipod_audio_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
     struct ipod_audio *audio = snd_pcm_substream_chip(substream);
 	unsigned long flags;
+	unsigned int gen;
 	int err = 0;
 
 	spin_lock_irqsave(&audio->play_lock, flags);
 
-	/* Reset */
-	audio->hw_ptr = 0;
+	// a new generation makes the completion side reset its pointers
+	gen = (audio->run_state >> 1) + 1;
 
 	switch (cmd)
 	{
 	case SNDRV_PCM_TRIGGER_START:
 	case SNDRV_PCM_TRIGGER_RESUME:
-		audio->ss = substream;
+		// packets sized for the host rate would repitch the ring
+		if (audio->rate && substream->runtime->rate != audio->rate) {
+			pr_warn("start: playback rate %u, host wants %u, reopen the pcm\n",
+				substream->runtime->rate, audio->rate);
+			err = -EINVAL;
+			break;
+		}
+		audio->pkt_rate = audio->rate ? audio->rate : substream->runtime->rate;
+		ipod_audio_select_cadence(audio);
+		smp_store_release(&audio->run_state, (gen << 1) | 1);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
 	case SNDRV_PCM_TRIGGER_SUSPEND:
-		audio->ss = NULL;
+		smp_store_release(&audio->run_state, gen << 1);
 		break;
 	default:
 		err = -EINVAL;
 	}
+	trace_ipod_audio_trigger(cmd, audio->run_state);
 
 	spin_unlock_irqrestore(&audio->play_lock, flags);
 
-	/* Clear buffer after Play stops */
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK && !audio->ss)
-		memset(audio->rbuf, 0, MAX_USB_AUDIO_PACKET_SIZE * NUM_USB_AUDIO_TRANSFERS);
-
 	return err;
 }
 
 static snd_pcm_uframes_t ipod_audio_pcm_hw_pointer(struct snd_pcm_substream *substream)
 {
     struct ipod_audio *audio = snd_pcm_substream_chip(substream);
-	return bytes_to_frames(substream->runtime, audio->hw_ptr);
+	unsigned int run_state = READ_ONCE(audio->run_state);
+
+	// completion hasn't picked up the new run yet
+	if (smp_load_acquire(&audio->hw_gen) != run_state) {
+		substream->runtime->delay = 0;
+		return 0;
+	}
+
+	// in zero copy mode queued packets still need their ring data
+	if (zero_copy) {
+		substream->runtime->delay = 0;
+		return bytes_to_frames(substream->runtime, READ_ONCE(audio->done_ptr));
+	}
+
+	// hw_ptr runs ahead of the wire by whatever sits in the UDC queue
+	substream->runtime->delay = bytes_to_frames(substream->runtime,
+		READ_ONCE(audio->queued_bytes));
+	return bytes_to_frames(substream->runtime, READ_ONCE(audio->hw_ptr));
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+/*
+ * Link timestamps: frames sent by the last completion plus whatever the
+ * host has pulled from the queue since, counted in USB frames.
+ */
+static int ipod_audio_pcm_get_time_info(struct snd_pcm_substream *substream,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	struct timespec64 *system_ts, struct timespec64 *audio_ts,
+#else
+	struct timespec *system_ts, struct timespec *audio_ts,
+#endif
+	struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+	struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct ipod_audio *audio = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned int seq;
+	int frame, now;
+	u32 elapsed_ms;
+	u64 bytes, frames, queued, ns;
+
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+
+	if (audio_tstamp_config->type_requested != SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK)
+		return 0;
+	if (!audio->in_ep_enabled ||
+		smp_load_acquire(&audio->hw_gen) != READ_ONCE(audio->run_state))
+		return 0;
+
+	do {
+		seq = read_seqcount_begin(&audio->ts_seq);
+		frame = audio->ts_frame;
+		bytes = audio->ts_bytes;
+	} while (read_seqcount_retry(&audio->ts_seq, seq));
+	queued = READ_ONCE(audio->queued_bytes);
+
+	now = usb_gadget_frame_number(audio->gadget);
+	snd_pcm_gettime(runtime, system_ts);
+	if (now < 0 || frame < 0)
+		return 0;
+
+	// at high speed UDCs report microframes
+	if (audio->high_speed)
+		elapsed_ms = ((now - frame) & 0x3fff) >> 3;
+	else
+		elapsed_ms = (now - frame) & 0x7ff;
+
+	frames = div_u64((u64)elapsed_ms * runtime->rate, 1000);
+	frames = min_t(u64, frames, bytes_to_frames(runtime, queued));
+	frames += bytes_to_frames(runtime, bytes);
+
+	ns = div_u64(frames * NSEC_PER_SEC, runtime->rate);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	*audio_ts = ns_to_timespec64(ns);
+#else
+	*audio_ts = ns_to_timespec(ns);
+#endif
+
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	audio_tstamp_report->accuracy_report = 1;
+	// one USB frame
+	audio_tstamp_report->accuracy = 1000000;
+	return 0;
+}
+#endif
+
 static int ipod_audio_pcm_null(struct snd_pcm_substream *substream)
 {
     struct ipod_audio *audio = snd_pcm_substream_chip(substream);
@@ -195,102 +762,418 @@ static struct snd_pcm_ops ipod_audio_pcm_ops = {
 	.hw_free = ipod_audio_pcm_hw_free,
 	.trigger = ipod_audio_pcm_trigger,
 	.pointer = ipod_audio_pcm_hw_pointer,
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	.get_time_info = ipod_audio_pcm_get_time_info,
+	#endif
 	.prepare = ipod_audio_pcm_null,
 };
 
+// The UDC refused req: park it and retry shortly.
+static void ipod_audio_req_lost(struct ipod_audio *audio, struct ipod_audio_req *ctx, int err)
+{
+	set_bit(ctx - audio->in_req, audio->req_lost_mask);
+	this_cpu_inc(audio->stats->req_lost);
+	pr_warn_ratelimited("queue: err=%d, %d requests left in flight\n",
+		err, atomic_read(&audio->req_inflight));
+	if (READ_ONCE(audio->in_ep_enabled))
+		hrtimer_start(&audio->rearm_timer, ns_to_ktime(USB_AUDIO_REARM_US * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+}
+
+/*
+ * Queue the lost requests again. They go out as silence, the audio they
+ * would have carried is long gone. Returns true if any are still lost.
+ */
+static bool ipod_audio_rearm(struct ipod_audio *audio)
+{
+	struct ipod_audio_req *ctx;
+	unsigned int i;
+
+	for_each_set_bit(i, audio->req_lost_mask, audio->req_number) {
+		if (!READ_ONCE(audio->in_ep_enabled))
+			return false;
+		if (!test_and_clear_bit(i, audio->req_lost_mask))
+			continue;
+		ctx = &audio->in_req[i];
+		memset(ctx->buf, 0, MAX_USB_AUDIO_PACKET_SIZE);
+		ctx->len = 0;
+		ctx->req->buf = ctx->buf;
+		atomic_inc(&audio->req_inflight);
+		trace_ipod_audio_req_submit(ctx->req, 0, audio->gadget);
+		if (usb_ep_queue(audio->in_ep, ctx->req, GFP_ATOMIC)) {
+			atomic_dec(&audio->req_inflight);
+			set_bit(i, audio->req_lost_mask);
+			continue;
+		}
+		this_cpu_inc(audio->stats->req_recovered);
+	}
+	return !bitmap_empty(audio->req_lost_mask, audio->req_number);
+}
+
+static enum hrtimer_restart ipod_audio_rearm_timer(struct hrtimer *timer)
+{
+	struct ipod_audio *audio = container_of(timer, struct ipod_audio, rearm_timer);
+
+	if (!ipod_audio_rearm(audio))
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(timer, ns_to_ktime(USB_AUDIO_REARM_US * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+static inline unsigned int ipod_audio_hist_bucket(u64 ns)
+{
+	return min_t(unsigned int, fls64(ns), AUDIO_HIST_BUCKETS - 1);
+}
+
+static void ipod_audio_count_status(struct ipod_audio *audio, int status)
+{
+	switch (status) {
+	case -EXDEV:
+		this_cpu_inc(audio->stats->errors[AUDIO_ERR_XDEV]);
+		break;
+	case -EOVERFLOW:
+		this_cpu_inc(audio->stats->errors[AUDIO_ERR_OVERFLOW]);
+		break;
+	case -EPROTO:
+		this_cpu_inc(audio->stats->errors[AUDIO_ERR_PROTO]);
+		break;
+	default:
+		this_cpu_inc(audio->stats->errors[AUDIO_ERR_OTHER]);
+	}
+}
+
 static void ipod_audio_iso_complete(struct usb_ep *ep, struct usb_request *req)
 {
 	unsigned pending;
-	unsigned long flags;
 	unsigned int hw_ptr;
+	unsigned int len;
+	unsigned int run_state;
 	bool update_alsa = false;
-	struct snd_pcm_substream *substream;
-    struct ipod_audio *audio = req->context;
+	struct ipod_audio_stream *st;
+	struct ipod_audio_cadence *cad;
+	struct ipod_audio_req *ctx = req->context;
+	struct ipod_audio *audio = ctx->audio;
+	u64 now = ktime_get_ns();
 	int ret;
 
-    //trace_printk("status=%d ep_enabled=%d\n", req->status, audio->in_ep_enabled);
-	//trace_ipod_req_out_done(req);
-
-	//if (req->status == -ESHUTDOWN)
-	if (!audio->in_ep_enabled || req->status)
-		return;
-	
-	// if(req->status) {
-	// 	usb_ep_free_request(audio->in_ep, req);
-	// 	return;
-	// }
+	trace_ipod_audio_req_complete(req, ctx->len, audio->gadget);
 
-	//if (audio->dma_area == NULL)
-	//	goto exit;
+	if (ctx->zero_copy) {
+		ctx->zero_copy = false;
+		req->buf = ctx->buf;
+		if (atomic_dec_and_test(&audio->zc_inflight))
+			wake_up(&audio->zc_wait);
+	}
 
-	substream = audio->ss;
+	atomic_dec(&audio->req_inflight);
 
-	if (!substream)
-		goto exit;
+	// dequeued or disconnected, the endpoint is going away
+	if (!audio->in_ep_enabled || req->status == -ESHUTDOWN ||
+		req->status == -ECONNRESET) {
+		if (ctx->len && ctx->run_state == audio->hw_gen)
+			WRITE_ONCE(audio->queued_bytes, audio->queued_bytes - ctx->len);
+		ctx->len = 0;
+		return;
+	}
 
-	spin_lock_irqsave(&audio->play_lock, flags);
+	/*
+	 * Anything else (a missed interval, an underrun in the UDC) cost the
+	 * host one packet but the slot still went by, so account for it as
+	 * sent and keep the request going.
+	 */
+	if (unlikely(req->status)) {
+		ipod_audio_count_status(audio, req->status);
+	} else {
+		this_cpu_inc(audio->stats->packets);
+		if (ctx->len)
+			this_cpu_add(audio->stats->bytes, ctx->len);
+		else
+			this_cpu_inc(audio->stats->silence);
+	}
+	if (audio->last_complete_ns)
+		this_cpu_inc(audio->stats->interval_hist[
+			ipod_audio_hist_bucket(now - audio->last_complete_ns)]);
+	audio->last_complete_ns = now;
+
+	rcu_read_lock();
+	st = rcu_dereference(audio->stream);
+	run_state = smp_load_acquire(&audio->run_state);
+	cad = READ_ONCE(audio->cad);
+
+	if (!st || !(run_state & 1) || unlikely(!cad))
+		goto silence;
+
+	// trigger started a new run, restart at the top of the ring
+	if (audio->hw_gen != run_state) {
+		audio->hw_ptr = 0;
+		audio->done_ptr = 0;
+		audio->queued_bytes = 0;
+		write_seqcount_begin(&audio->ts_seq);
+		audio->ts_frame = -1;
+		audio->ts_bytes = 0;
+		write_seqcount_end(&audio->ts_seq);
+		audio->cad_acc = 0;
+		ipod_audio_drift_reset(audio);
+		audio->drift_primed = false;
+		smp_store_release(&audio->hw_gen, run_state);
+	}
 
-	if (audio->cnt < 9)
-	{
-		req->length = 176;
-		req->actual = 176;
+	len = cad->base;
+	audio->cad_acc += cad->frac;
+	if (audio->cad_acc >= cad->mod) {
+		audio->cad_acc -= cad->mod;
+		len += cad->step;
 	}
-	else
-	{
-		req->length = 180;
-		req->actual = 180;
+
+	// the packet that just went out
+	if (ctx->len && ctx->run_state == run_state) {
+		WRITE_ONCE(audio->queued_bytes, audio->queued_bytes - ctx->len);
+		write_seqcount_begin(&audio->ts_seq);
+		audio->ts_frame = usb_gadget_frame_number(audio->gadget);
+		audio->ts_bytes += ctx->len;
+		write_seqcount_end(&audio->ts_seq);
 	}
-	audio->cnt = (audio->cnt + 1) % 10;
 
-	pending = audio->hw_ptr % audio->period_size;
-	pending += req->actual;
-	if (pending >= audio->period_size)
-		update_alsa = true;
+	if (zero_copy) {
+		// ALSA may now reuse what the completed packet pointed at
+		if (ctx->len && ctx->run_state == run_state) {
+			pending = audio->done_ptr % st->period_size;
+			pending += ctx->len;
+			if (pending >= st->period_size)
+				update_alsa = true;
+			WRITE_ONCE(audio->done_ptr, ctx->ptr);
+		}
+	} else {
+		pending = audio->hw_ptr % st->period_size;
+		pending += len;
+		if (pending >= st->period_size)
+			update_alsa = true;
+	}
 
 	hw_ptr = audio->hw_ptr;
-	audio->hw_ptr = (audio->hw_ptr + req->actual) % audio->dma_bytes;
+	WRITE_ONCE(audio->hw_ptr, (hw_ptr + len) % st->dma_bytes);
 
-	spin_unlock_irqrestore(&audio->play_lock, flags);
+	ctx->ptr = audio->hw_ptr;
+	ctx->len = len;
+	ctx->run_state = run_state;
+	WRITE_ONCE(audio->queued_bytes, audio->queued_bytes + len);
+
+	req->length = len;
+	req->actual = len;
 
 	/* Pack USB load in ALSA ring buffer */
-	pending = audio->dma_bytes - hw_ptr;
+	pending = st->dma_bytes - hw_ptr;
 
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+	if (zero_copy && likely(pending >= len))
 	{
-		if (unlikely(pending < req->actual))
-		{
-			//printk("Oops: %d / %d \n", pending, req->actual);
-			memcpy(req->buf, audio->dma_area + hw_ptr, pending);
-			memcpy(req->buf + pending, audio->dma_area,
-				   req->actual - pending);
-		}
-		else
-		{
-			memcpy(req->buf, audio->dma_area + hw_ptr, req->actual);
-		}
+		req->buf = st->dma_area + hw_ptr;
+		ctx->zero_copy = true;
+		atomic_inc(&audio->zc_inflight);
+	}
+	else if (unlikely(pending < len))
+	{
+		//printk("Oops: %d / %d \n", pending, len);
+		memcpy(req->buf, st->dma_area + hw_ptr, pending);
+		memcpy(req->buf + pending, st->dma_area, len - pending);
+	}
+	else
+	{
+		memcpy(req->buf, st->dma_area + hw_ptr, len);
+	}
+	goto exit;
+
+silence:
+	// clear what the last audio packet left in the bounce buffer
+	if (ctx->len) {
+		memset(ctx->buf, 0, MAX_USB_AUDIO_PACKET_SIZE);
+		ctx->len = 0;
 	}
 
 exit:
 
 	//req->length = MAX_USB_AUDIO_PACKET_SIZE;
 	//req->actual = req->length;
+	atomic_inc(&audio->req_inflight);
+	trace_ipod_audio_req_submit(req, ctx->len, audio->gadget);
 	ret = usb_ep_queue(audio->in_ep, req, GFP_ATOMIC);
 	if (ret) {
-		trace_printk("queue: err=%d\n", ret);
+		atomic_dec(&audio->req_inflight);
+		if (ctx->len) {
+			WRITE_ONCE(audio->queued_bytes, audio->queued_bytes - ctx->len);
+			ctx->len = 0;
+		}
+		if (ctx->zero_copy) {
+			ctx->zero_copy = false;
+			req->buf = ctx->buf;
+			if (atomic_dec_and_test(&audio->zc_inflight))
+				wake_up(&audio->zc_wait);
+		}
+		ipod_audio_req_lost(audio, ctx, ret);
+	} else if (unlikely(!bitmap_empty(audio->req_lost_mask, audio->req_number))) {
+		// the UDC takes requests again, bring the lost ones back
+		ipod_audio_rearm(audio);
 	}
 
-	if (update_alsa)
-		snd_pcm_period_elapsed(substream);
+	if (update_alsa) {
+		trace_ipod_audio_period_elapsed(zero_copy ? audio->done_ptr : audio->hw_ptr,
+			st->period_size, audio->queued_bytes);
+		snd_pcm_period_elapsed(st->ss);
+		this_cpu_inc(audio->stats->periods);
+		// ALSA stops the stream from inside period_elapsed on an xrun
+		if (READ_ONCE(st->ss->runtime->status->state) == SNDRV_PCM_STATE_XRUN)
+			this_cpu_inc(audio->stats->xruns);
+		else
+			ipod_audio_drift_update(audio, st);
+	}
 
+	rcu_read_unlock();
+	this_cpu_inc(audio->stats->exec_hist[
+		ipod_audio_hist_bucket(ktime_get_ns() - now)]);
 	return;
 }
 
+// Sums the per CPU counters into *sum.
+static void ipod_audio_stats_sum(struct ipod_audio *audio, struct ipod_audio_stats *sum)
+{
+	struct ipod_audio_stats *s;
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(audio->stats, cpu);
+		sum->packets += s->packets;
+		sum->bytes += s->bytes;
+		sum->silence += s->silence;
+		for (i = 0; i < NR_AUDIO_ERR; i++)
+			sum->errors[i] += s->errors[i];
+		sum->req_lost += s->req_lost;
+		sum->req_recovered += s->req_recovered;
+		sum->periods += s->periods;
+		sum->xruns += s->xruns;
+		for (i = 0; i < AUDIO_HIST_BUCKETS; i++) {
+			sum->interval_hist[i] += s->interval_hist[i];
+			sum->exec_hist[i] += s->exec_hist[i];
+		}
+	}
+}
+
+static void ipod_audio_stats_hist(struct seq_file *m, const char *name, const u64 *hist)
+{
+	unsigned int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < AUDIO_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		seq_printf(m, "  >= %llu ns: %llu\n", i ? 1ULL << (i - 1) : 0ULL, hist[i]);
+	}
+}
+
+static int ipod_audio_stats_show(struct seq_file *m, void *unused)
+{
+	struct ipod_audio *audio = m->private;
+	struct ipod_audio_stats *sum;
+	unsigned int i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	ipod_audio_stats_sum(audio, sum);
+
+	seq_printf(m, "packets: %llu\n", sum->packets);
+	seq_printf(m, "bytes: %llu\n", sum->bytes);
+	seq_printf(m, "silence: %llu\n", sum->silence);
+	for (i = 0; i < NR_AUDIO_ERR; i++)
+		seq_printf(m, "errors %s: %llu\n", ipod_audio_err_names[i], sum->errors[i]);
+	seq_printf(m, "requeue failures: %llu\n", sum->req_lost);
+	seq_printf(m, "requeue recovered: %llu\n", sum->req_recovered);
+	seq_printf(m, "periods: %llu\n", sum->periods);
+	seq_printf(m, "xruns: %llu\n", sum->xruns);
+	seq_printf(m, "queue depth: %d/%u\n", READ_ONCE(audio->in_ep_enabled) ?
+		atomic_read(&audio->req_inflight) : 0, audio->req_number);
+	ipod_audio_stats_hist(m, "completion interval", sum->interval_hist);
+	ipod_audio_stats_hist(m, "completion time", sum->exec_hist);
+
+	kfree(sum);
+	return 0;
+}
+
+static int ipod_audio_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ipod_audio_stats_show, inode->i_private);
+}
+
+static const struct file_operations ipod_audio_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ipod_audio_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 
 
+static void ipod_audio_set_rate_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct ipod_audio *audio = req->context;
+	u8 *buf = req->buf;
+	unsigned int rate;
+	struct ipod_audio_stream *st;
+	unsigned long flags;
+	bool stop;
+
+	if (req->status || req->actual < 3) {
+		pr_warn("set rate: status=%d actual=%d\n", req->status, req->actual);
+		return;
+	}
+
+	rate = buf[0] | (buf[1] << 8) | (buf[2] << 16);
+	if (!ipod_audio_rate_valid(rate)) {
+		pr_warn("set rate: unsupported %u\n", rate);
+		return;
+	}
+
+	pr_info("host selected rate %u\n", rate);
+	rcu_read_lock();
+	st = rcu_dereference(audio->stream);
+
+	/*
+	 * A stream set up for another rate would play at the wrong pitch,
+	 * whether it runs already or starts later. Keep the old cadence
+	 * while it runs and disconnect it, the next open is limited to the
+	 * new rate. trigger refuses to start a mismatch that slips past.
+	 */
+	spin_lock(&audio->play_lock);
+	audio->rate = rate;
+	stop = st && st->ss->runtime->rate != rate;
+	if (!stop || !(audio->run_state & 1)) {
+		audio->pkt_rate = rate;
+		ipod_audio_select_cadence(audio);
+	}
+	spin_unlock(&audio->play_lock);
+
+	// outside play_lock, trigger takes it under the stream lock
+	if (stop) {
+		pr_warn("host rate %u differs from playback rate %u, disconnecting, reopen the pcm\n",
+			rate, st->ss->runtime->rate);
+		snd_pcm_stream_lock_irqsave(st->ss, flags);
+		if (st->ss->runtime->status->state != SNDRV_PCM_STATE_DISCONNECTED)
+			snd_pcm_stop(st->ss, SNDRV_PCM_STATE_DISCONNECTED);
+		snd_pcm_stream_unlock_irqrestore(st->ss, flags);
+	}
+	rcu_read_unlock();
+}
+
 int ipod_audio_setup(struct usb_function *func, const struct usb_ctrlrequest *ctrl)
 {
+	struct ipod_audio *audio = func_to_ipod_audio(func);
 	struct usb_composite_dev *cdev = func->config->cdev;
 	struct usb_request *req = cdev->req;
+	u8 *buf = req->buf;
+	unsigned int rate;
+	bool ep_rate = (ctrl->bRequestType & USB_RECIP_MASK) == USB_RECIP_ENDPOINT
+		&& (le16_to_cpu(ctrl->wValue) >> 8) == UAC_EP_CS_ATTR_SAMPLE_RATE;
 
 	u16 w_index = le16_to_cpu(ctrl->wIndex);
 	u16 w_value = le16_to_cpu(ctrl->wValue);
@@ -304,6 +1187,10 @@ int ipod_audio_setup(struct usb_function *func, const struct usb_ctrlrequest *ct
 
 	switch (ctrl->bRequest) {
 	case UAC_SET_CUR:
+		if (ep_rate) {
+			req->context = audio;
+			req->complete = ipod_audio_set_rate_complete;
+		}
 		req->zero = 0;
 		req->length = w_length;
 		status = usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
@@ -316,6 +1203,25 @@ int ipod_audio_setup(struct usb_function *func, const struct usb_ctrlrequest *ct
 		return status;
 		break;
 	case UAC_GET_CUR:
+		if (ep_rate && w_length >= 3) {
+			rate = audio->rate ? audio->rate : DEFAULT_SAMPLE_RATE;
+			buf[0] = rate;
+			buf[1] = rate >> 8;
+			buf[2] = rate >> 16;
+			req->zero = 0;
+			req->length = 3;
+			status = usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+			if (status < 0)
+				ERROR(cdev, "usb_ep_queue error on ep0 %d\n", status);
+			return status;
+		}
+		req->zero = 0;
+		req->length = w_length;
+		status = usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+		if (status < 0)
+			ERROR(cdev, "usb_ep_queue error on ep0 %d\n", status);
+		return status;
+		break;
 	case UAC_GET_MIN:
 	case UAC_GET_MAX:
 	case UAC_GET_RES:
@@ -335,6 +1241,7 @@ int ipod_audio_start(struct ipod_audio* audio) {
     int ret = 0;
     int i;
     struct usb_request *req;
+	unsigned long flags;
 
 	pr_info("audio start\n");
 
@@ -348,6 +1255,11 @@ int ipod_audio_start(struct ipod_audio* audio) {
         DBG(audio->func.config->cdev, "config_ep_by_speed FAILED!\n");
         return ret;
     }
+
+	spin_lock_irqsave(&audio->play_lock, flags);
+	audio->high_speed = audio->func.config->cdev->gadget->speed >= USB_SPEED_HIGH;
+	ipod_audio_select_cadence(audio);
+	spin_unlock_irqrestore(&audio->play_lock, flags);
 	
     ret = usb_ep_enable(audio->in_ep);
     if (ret < 0)
@@ -358,44 +1270,87 @@ int ipod_audio_start(struct ipod_audio* audio) {
 
 	usb_ep_fifo_flush(audio->in_ep);
     
-
+	bitmap_zero(audio->req_lost_mask, MAX_USB_AUDIO_TRANSFERS);
+	atomic_set(&audio->req_inflight, 0);
+	audio->last_complete_ns = 0;
     
-    for (i = 0; i < NUM_USB_AUDIO_TRANSFERS; i++){
-        if (!audio->in_req[i]) {
+    for (i = 0; i < audio->req_number; i++){
+        if (!audio->in_req[i].req) {
             req = usb_ep_alloc_request(audio->in_ep, GFP_ATOMIC);
             if(req == NULL) {
                 return -ENOMEM;
             }
-            audio->in_req[i] = req;
+            audio->in_req[i].req = req;
+            audio->in_req[i].audio = audio;
+            audio->in_req[i].buf = audio->rbuf + i * MAX_USB_AUDIO_PACKET_SIZE;
+            audio->in_req[i].len = 0;
+            audio->in_req[i].zero_copy = false;
             req->zero = 0;
-            req->context = audio;
+            req->context = &audio->in_req[i];
             req->length = MAX_USB_AUDIO_PACKET_SIZE;
             req->complete = ipod_audio_iso_complete;
-            req->buf = audio->rbuf + i * MAX_USB_AUDIO_PACKET_SIZE;
+            req->buf = audio->in_req[i].buf;
+            // the UDC gives back the quiet ones with the next interrupt
+            req->no_interrupt = (i + 1) % audio->irq_interval != 0;
         }
 
-        if (usb_ep_queue(audio->in_ep, audio->in_req[i], GFP_ATOMIC)){
+        atomic_inc(&audio->req_inflight);
+        trace_ipod_audio_req_submit(audio->in_req[i].req, 0, audio->gadget);
+        ret = usb_ep_queue(audio->in_ep, audio->in_req[i].req, GFP_ATOMIC);
+        if (ret) {
             ERROR(audio->func.config->cdev, "usb_ep_queue error on ep0\n");
+            atomic_dec(&audio->req_inflight);
+            ipod_audio_req_lost(audio, &audio->in_req[i], ret);
         }
     }
     
     return 0;
 }
 
+static void ipod_audio_stop_summary(struct ipod_audio *audio)
+{
+	struct ipod_audio_stats *sum;
+	u64 errors = 0;
+	unsigned int i;
+
+	if (!audio->stats)
+		return;
+	sum = kmalloc(sizeof(*sum), GFP_ATOMIC);
+	if (!sum)
+		return;
+	ipod_audio_stats_sum(audio, sum);
+	for (i = 0; i < NR_AUDIO_ERR; i++)
+		errors += sum->errors[i];
+	pr_info("audio stop: %llu iso errors, %llu requests lost, %llu recovered since bind\n",
+		errors, sum->req_lost, sum->req_recovered);
+	kfree(sum);
+}
+
 int ipod_audio_stop(struct ipod_audio* audio) {
     int i;
+	unsigned long flags;
     pr_info("audio stop\n");
+	spin_lock_irqsave(&audio->ep_lock, flags);
     if(!audio->in_ep_enabled) {
+		spin_unlock_irqrestore(&audio->ep_lock, flags);
         return 0;
     }
     audio->in_ep_enabled = false;
-    for (i = 0; i < NUM_USB_AUDIO_TRANSFERS; i++) {
-        if(audio->in_req[i]) {
-            usb_ep_dequeue(audio->in_ep, audio->in_req[i]);
-            usb_ep_free_request(audio->in_ep, audio->in_req[i]);
-            audio->in_req[i] = NULL;
+	audio->ep_gen++;
+	spin_unlock_irqrestore(&audio->ep_lock, flags);
+    // no rearm from here on, the requests are about to go
+    hrtimer_cancel(&audio->rearm_timer);
+    ipod_audio_stop_summary(audio);
+	// hw_free may be dequeueing zero copy requests right now
+	spin_lock_irqsave(&audio->ep_lock, flags);
+    for (i = 0; i < audio->req_number; i++) {
+        if(audio->in_req[i].req) {
+            usb_ep_dequeue(audio->in_ep, audio->in_req[i].req);
+            usb_ep_free_request(audio->in_ep, audio->in_req[i].req);
+            audio->in_req[i].req = NULL;
         }
     }
+	spin_unlock_irqrestore(&audio->ep_lock, flags);
 				
 	usb_ep_disable(audio->in_ep);
 
@@ -405,6 +1360,7 @@ int ipod_audio_stop(struct ipod_audio* audio) {
 int ipod_audio_set_alt(struct usb_function *func, unsigned intf, unsigned alt)
 {
     struct ipod_audio *audio = func_to_ipod_audio(func);
+	int ret;
 	DBG(func->config->cdev, " = %s(%u,%u) \n", __FUNCTION__, intf, alt);
 
     if (intf == audio->ac_intf) {
@@ -419,9 +1375,13 @@ int ipod_audio_set_alt(struct usb_function *func, unsigned intf, unsigned alt)
         audio->as_alt = alt;
         switch(alt) {
         case 0:
-            return ipod_audio_stop(audio);
+            ret = ipod_audio_stop(audio);
+            trace_ipod_audio_stream(false, audio->req_number, ret);
+            return ret;
         case 1:
-            return ipod_audio_start(audio);
+            ret = ipod_audio_start(audio);
+            trace_ipod_audio_stream(true, audio->req_number, ret);
+            return ret;
         default:
             return -EINVAL;
         }
@@ -449,9 +1409,11 @@ int ipod_audio_get_alt(struct usb_function *func, unsigned intf)
 void ipod_audio_disable(struct usb_function *func)
 {
 	struct ipod_audio *audio = func_to_ipod_audio(func);
+	int ret;
 	DBG(func->config->cdev, " = %s() \n", __FUNCTION__);
 	audio->as_alt = 0;
-	ipod_audio_stop(audio);
+	ret = ipod_audio_stop(audio);
+	trace_ipod_audio_stream(false, audio->req_number, ret);
 	
 }
 
@@ -508,12 +1470,32 @@ int ipod_audio_bind(struct usb_configuration *conf, struct usb_function *func)
         return ret;
     }
 
-	audio->rbuf = kzalloc(MAX_USB_AUDIO_PACKET_SIZE * NUM_USB_AUDIO_TRANSFERS, GFP_KERNEL);
-	audio->in_req = kzalloc(NUM_USB_AUDIO_TRANSFERS * sizeof(struct usb_request *), GFP_KERNEL);
-	for (i = 0; i < NUM_USB_AUDIO_TRANSFERS; i++)
+	audio->rbuf = kzalloc(MAX_USB_AUDIO_PACKET_SIZE * audio->req_number, GFP_KERNEL);
+	audio->in_req = kcalloc(audio->req_number, sizeof(*audio->in_req), GFP_KERNEL);
+	audio->stats = alloc_percpu(struct ipod_audio_stats);
+	if (!audio->rbuf || !audio->in_req || !audio->stats)
 	{
-		audio->in_req[i] = NULL;
+		kfree(audio->rbuf);
+		kfree(audio->in_req);
+		free_percpu(audio->stats);
+		audio->stats = NULL;
+		return -ENOMEM;
 	}
+	atomic_set(&audio->zc_inflight, 0);
+	init_waitqueue_head(&audio->zc_wait);
+	spin_lock_init(&audio->play_lock);
+	spin_lock_init(&audio->ep_lock);
+	seqcount_init(&audio->ts_seq);
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	hrtimer_setup(&audio->rearm_timer, ipod_audio_rearm_timer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL);
+	#else
+	hrtimer_init(&audio->rearm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	audio->rearm_timer.function = ipod_audio_rearm_timer;
+	#endif
+	audio->ts_frame = -1;
+	audio->gadget = conf->cdev->gadget;
+	ipod_audio_build_cadence(audio, 0);
 
 	//AUDIO CARD
 	audio->pdev = platform_device_alloc("snd_usb_ipod", -1);
@@ -552,6 +1534,23 @@ int ipod_audio_bind(struct usb_configuration *conf, struct usb_function *func)
     audio->pcm->private_data = audio;
 
 	snd_pcm_set_ops(audio->pcm, SNDRV_PCM_STREAM_PLAYBACK, &ipod_audio_pcm_ops);
+
+	audio->drift_kctl = snd_ctl_new1(&ipod_audio_drift_ctl, audio);
+	ret = snd_ctl_add(audio->card, audio->drift_kctl);
+	if (ret)
+	{
+		DBG(conf->cdev, "Coudn't add drift control: %d", ret);
+		audio->drift_kctl = NULL;
+		goto snd_fail;
+	}
+	audio->corr_kctl = snd_ctl_new1(&ipod_audio_corr_ctl, audio);
+	ret = snd_ctl_add(audio->card, audio->corr_kctl);
+	if (ret)
+	{
+		DBG(conf->cdev, "Coudn't add correction control: %d", ret);
+		audio->corr_kctl = NULL;
+		goto snd_fail;
+	}
 	
 	
 	#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0))
@@ -575,15 +1574,28 @@ int ipod_audio_bind(struct usb_configuration *conf, struct usb_function *func)
 		goto snd_fail;
 	}
 
+	if (ipod_audio_debugfs_root) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "card%d", audio->card->number);
+		audio->debugfs = debugfs_create_dir(name, ipod_audio_debugfs_root);
+		debugfs_create_file("stats", 0444, audio->debugfs, audio,
+			&ipod_audio_stats_fops);
+	}
+
 	return 0;
 
 snd_fail:
+	audio->drift_kctl = NULL;
+	audio->corr_kctl = NULL;
 	snd_card_free(audio->card);
 	audio->card = NULL;
 	audio->pcm = NULL;
 pdev_fail:
 	platform_device_del(audio->pdev);
 	audio->pdev = NULL;
+	free_percpu(audio->stats);
+	audio->stats = NULL;
 	return ret;
 }
 
@@ -593,8 +1605,13 @@ void ipod_audio_unbind(struct usb_configuration *conf, struct usb_function *func
     struct ipod_audio *audio = func_to_ipod_audio(func);
 	DBG(conf->cdev, " = %s() \n", __FUNCTION__);
 
+	debugfs_remove_recursive(audio->debugfs);
+	audio->debugfs = NULL;
+
 	if (audio->card != NULL)
 	{
+		audio->drift_kctl = NULL;
+		audio->corr_kctl = NULL;
 		snd_card_free(audio->card);
         platform_device_del(audio->pdev);
 		audio->card = NULL;
@@ -602,12 +1619,13 @@ void ipod_audio_unbind(struct usb_configuration *conf, struct usb_function *func
 		audio->pdev = NULL;
 	}
 
-	for (i = 0; i < NUM_USB_AUDIO_TRANSFERS; i++)
+	hrtimer_cancel(&audio->rearm_timer);
+	for (i = 0; i < audio->req_number; i++)
 	{
-		if (audio->in_req[i] != NULL)
+		if (audio->in_req[i].req != NULL)
 		{
-			usb_ep_free_request(audio->in_ep, audio->in_req[i]);
-			audio->in_req[i] = NULL;
+			usb_ep_free_request(audio->in_ep, audio->in_req[i].req);
+			audio->in_req[i].req = NULL;
 		}
 	}
 
@@ -617,22 +1635,40 @@ void ipod_audio_unbind(struct usb_configuration *conf, struct usb_function *func
 	#endif
 	audio->in_ep = NULL;
 	kfree(audio->rbuf);
+	kfree(audio->in_req);
+	free_percpu(audio->stats);
+	audio->stats = NULL;
 }
 
 static void ipod_audio_free(struct usb_function *func) 
 {
     struct ipod_audio *audio = func_to_ipod_audio(func);
+	struct ipod_audio_opts *opts
+		= container_of(func->fi, struct ipod_audio_opts, fi);
+
+	mutex_lock(&opts->lock);
+	opts->refcnt--;
+	mutex_unlock(&opts->lock);
+
     kfree(audio);
 }
 
 static struct usb_function *ipod_audio_alloc(struct usb_function_instance *fi)
 {
 	struct ipod_audio *audio;
+	struct ipod_audio_opts *opts
+		= container_of(fi, struct ipod_audio_opts, fi);
 
 	audio = kzalloc(sizeof(*audio), GFP_KERNEL);
 	if (!audio)
 		return ERR_PTR(-ENOMEM);
 
+	mutex_lock(&opts->lock);
+	opts->refcnt++;
+	// the stores keep irq_interval <= req_number / 2
+	audio->req_number = opts->req_number;
+	audio->irq_interval = opts->irq_interval;
+	mutex_unlock(&opts->lock);
 
     audio->func.name = "ipod_audio";
     audio->func.bind = ipod_audio_bind;
@@ -650,7 +1686,9 @@ static struct usb_function *ipod_audio_alloc(struct usb_function_instance *fi)
 
 static void ipod_audio_free_inst(struct usb_function_instance *fi)
 {
-	kfree(fi);
+	struct ipod_audio_opts *opts
+		= container_of(fi, struct ipod_audio_opts, fi);
+	kfree(opts);
 }
 
 static void ipod_attr_release(struct config_item *item)
@@ -664,24 +1702,113 @@ static struct configfs_item_operations ipod_item_ops = {
 	.release	= ipod_attr_release,
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+static inline struct ipod_audio_opts *to_ipod_audio_opts(struct config_item *item)
+{
+	return container_of(to_config_group(item), struct ipod_audio_opts, fi.group);
+}
+
+#define IPOD_AUDIO_OPTS_ATTR(name, min, max)					\
+static ssize_t ipod_audio_opts_##name##_show(struct config_item *item,	\
+					     char *page)			\
+{									\
+	struct ipod_audio_opts *opts = to_ipod_audio_opts(item);	\
+	int result;							\
+									\
+	mutex_lock(&opts->lock);					\
+	result = sprintf(page, "%u\n", opts->name);			\
+	mutex_unlock(&opts->lock);					\
+	return result;							\
+}									\
+									\
+static ssize_t ipod_audio_opts_##name##_store(struct config_item *item,	\
+					      const char *page, size_t len)	\
+{									\
+	struct ipod_audio_opts *opts = to_ipod_audio_opts(item);	\
+	unsigned int num;						\
+	int ret;							\
+									\
+	mutex_lock(&opts->lock);					\
+	if (opts->refcnt) {						\
+		ret = -EBUSY;						\
+		goto end;						\
+	}								\
+	ret = kstrtouint(page, 0, &num);				\
+	if (ret)							\
+		goto end;						\
+	if (num < min || num > max) {					\
+		ret = -EINVAL;						\
+		goto end;						\
+	}								\
+	opts->name = num;						\
+	ret = len;							\
+end:									\
+	mutex_unlock(&opts->lock);					\
+	return ret;							\
+}									\
+									\
+CONFIGFS_ATTR(ipod_audio_opts_, name)
+
+// at least two interrupts per queue so it never runs dry, checked both ways
+// so neither attribute can leave the pair invalid
+IPOD_AUDIO_OPTS_ATTR(req_number, max(2U, opts->irq_interval * 2), MAX_USB_AUDIO_TRANSFERS);
+IPOD_AUDIO_OPTS_ATTR(irq_interval, 1, opts->req_number / 2);
+
+static struct configfs_attribute *ipod_audio_attrs[] = {
+	&ipod_audio_opts_attr_req_number,
+	&ipod_audio_opts_attr_irq_interval,
+	NULL,
+};
+#endif
+
 static struct config_item_type ipod_audio_func_type = {
 	.ct_owner	 = THIS_MODULE,
     .ct_item_ops = &ipod_item_ops,
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	.ct_attrs = ipod_audio_attrs,
+	#endif
 };
 
 static struct usb_function_instance *ipod_audio_alloc_inst(void)
 {
-	struct usb_function_instance *fi;
-	fi = kzalloc(sizeof(*fi), GFP_KERNEL);
-	if (!fi)
+	struct ipod_audio_opts *opts;
+	opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+	if (!opts)
 		return ERR_PTR(-ENOMEM);
-	
-	fi->free_func_inst = ipod_audio_free_inst;
-	config_group_init_type_name(&fi->group, "", &ipod_audio_func_type);
-	return fi;
+
+	mutex_init(&opts->lock);
+	opts->req_number = NUM_USB_AUDIO_TRANSFERS;
+	opts->irq_interval = USB_AUDIO_IRQ_INTERVAL;
+
+	opts->fi.free_func_inst = ipod_audio_free_inst;
+	config_group_init_type_name(&opts->fi.group, "", &ipod_audio_func_type);
+	return &opts->fi;
+}
+
+DECLARE_USB_FUNCTION(ipod_audio, ipod_audio_alloc_inst, ipod_audio_alloc);
+
+static int __init ipod_audio_mod_init(void)
+{
+	int ret;
+
+	// stats are optional, carry on without them
+	ipod_audio_debugfs_root = debugfs_create_dir("ipod_audio", NULL);
+	if (IS_ERR(ipod_audio_debugfs_root))
+		ipod_audio_debugfs_root = NULL;
+
+	ret = usb_function_register(&ipod_audiousb_func);
+	if (ret)
+		debugfs_remove_recursive(ipod_audio_debugfs_root);
+	return ret;
+}
+static void __exit ipod_audio_mod_exit(void)
+{
+	usb_function_unregister(&ipod_audiousb_func);
+	debugfs_remove_recursive(ipod_audio_debugfs_root);
 }
 
-DECLARE_USB_FUNCTION_INIT(ipod_audio, ipod_audio_alloc_inst, ipod_audio_alloc);
+module_init(ipod_audio_mod_init);
+module_exit(ipod_audio_mod_exit);
 
 MODULE_AUTHOR("Andrew Onyshchuk");
 MODULE_LICENSE("GPL");
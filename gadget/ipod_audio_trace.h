@@ -0,0 +1,119 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ipod_audio
+
+#if !defined(__IPOD_AUDIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __IPOD_AUDIO_TRACE_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+#include <linux/usb/gadget.h>
+
+/*
+ * The frame number is read in TP_fast_assign, so the UDC is only asked
+ * for it while the event is enabled.
+ */
+DECLARE_EVENT_CLASS(ipod_audio_req,
+
+	TP_PROTO(struct usb_request *req, unsigned int audio_len, struct usb_gadget *gadget),
+	TP_ARGS(req, audio_len, gadget),
+
+	TP_STRUCT__entry(
+			__field(    			void *,    ptr    )
+			__field(    unsigned int,    length    )
+			__field(    unsigned int,    audio_len    )
+			__field(     				 int,    status    )
+			__field(     				 int,    frame    )
+	),
+
+	TP_fast_assign(
+			__entry->ptr = req;
+			__entry->length = req->length;
+			__entry->audio_len = audio_len;
+			__entry->status = req->status;
+			__entry->frame = usb_gadget_frame_number(gadget);
+	),
+
+	TP_printk("%p len:%3u audio:%3u status:%d frame:%d", __entry->ptr,
+		__entry->length, __entry->audio_len, __entry->status, __entry->frame)
+);
+
+// handed to the UDC, audio_len is 0 for silence
+DEFINE_EVENT(ipod_audio_req, ipod_audio_req_submit,
+	TP_PROTO(struct usb_request *req, unsigned int audio_len, struct usb_gadget *gadget),
+	TP_ARGS(req, audio_len, gadget)
+);
+
+// given back by the UDC, before it is refilled
+DEFINE_EVENT(ipod_audio_req, ipod_audio_req_complete,
+	TP_PROTO(struct usb_request *req, unsigned int audio_len, struct usb_gadget *gadget),
+	TP_ARGS(req, audio_len, gadget)
+);
+
+TRACE_EVENT(ipod_audio_period_elapsed,
+
+	TP_PROTO(size_t hw_ptr, size_t period_size, unsigned int queued_bytes),
+	TP_ARGS(hw_ptr, period_size, queued_bytes),
+
+	TP_STRUCT__entry(
+			__field(    size_t,    hw_ptr    )
+			__field(    size_t,    period_size    )
+			__field(    unsigned int,    queued_bytes    )
+	),
+
+	TP_fast_assign(
+			__entry->hw_ptr = hw_ptr;
+			__entry->period_size = period_size;
+			__entry->queued_bytes = queued_bytes;
+	),
+
+	TP_printk("hw_ptr:%zu period:%zu queued:%u", __entry->hw_ptr,
+		__entry->period_size, __entry->queued_bytes)
+);
+
+TRACE_EVENT(ipod_audio_trigger,
+
+	TP_PROTO(int cmd, unsigned int run_state),
+	TP_ARGS(cmd, run_state),
+
+	TP_STRUCT__entry(
+			__field(     				 int,    cmd    )
+			__field(    unsigned int,    run_state    )
+	),
+
+	TP_fast_assign(
+			__entry->cmd = cmd;
+			__entry->run_state = run_state;
+	),
+
+	TP_printk("cmd:%d gen:%u running:%d", __entry->cmd,
+		__entry->run_state >> 1, __entry->run_state & 1)
+);
+
+// streaming interface alt setting 1 (enable) or 0
+TRACE_EVENT(ipod_audio_stream,
+
+	TP_PROTO(bool enable, unsigned int req_number, int ret),
+	TP_ARGS(enable, req_number, ret),
+
+	TP_STRUCT__entry(
+			__field(    bool,    enable    )
+			__field(    unsigned int,    req_number    )
+			__field(     				 int,    ret    )
+	),
+
+	TP_fast_assign(
+			__entry->enable = enable;
+			__entry->req_number = req_number;
+			__entry->ret = ret;
+	),
+
+	TP_printk("%s reqs:%u ret:%d", __entry->enable ? "start" : "stop",
+		__entry->req_number, __entry->ret)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE ipod_audio_trace
+#include <trace/define_trace.h>
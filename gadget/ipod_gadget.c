@@ -23,6 +23,10 @@ static bool swap_configs = false;
 module_param(swap_configs, bool, 0);
 MODULE_PARM_DESC(swap_configs, "Present iPod USB config as #1");
 
+static bool full_speed = false;
+module_param(full_speed, bool, 0);
+MODULE_PARM_DESC(full_speed, "Enumerate at full speed only (small HID report map)");
+
 static ushort product_id = 0;
 module_param(product_id, ushort, 0);
 MODULE_PARM_DESC(product_id, "Override USB Product ID");
@@ -185,7 +189,7 @@ static struct usb_composite_driver ipod_driver = {
 	.name = "g_ipod",
 	.dev = &device_desc,
 	.strings = ipod_strings,
-	.max_speed = USB_SPEED_FULL,
+	.max_speed = USB_SPEED_HIGH,
 
 	.bind = ipod_bind,
 	.unbind = ipod_unbind,
@@ -208,6 +212,11 @@ static int __init ipod_init(void)
 		pr_info("swapping usb configuration: ipod is #1\n");
 	}
 
+	if(full_speed) {
+		ipod_driver.max_speed = USB_SPEED_FULL;
+		pr_info("limiting to full speed\n");
+	}
+
 	if(product_id != 0) {
 		device_desc.idProduct = cpu_to_le16(product_id);
 		pr_info("override usb idProduct: %04x\n", product_id);
@@ -15,6 +15,16 @@
 #include <linux/types.h>
 #include <linux/poll.h>
 #include <linux/kfifo.h>
+#include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <sound/core.h>
 #include <sound/pcm.h>
@@ -22,12 +32,125 @@
 #include <linux/platform_device.h>
 
 #include "ipod.h"
-//#include "ipod_hid.h"
+#include "ipod_hid.h"
+
+#define CREATE_TRACE_POINTS
+#include "ipod_hid_trace.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
+#define kvzalloc(size, flags) vzalloc(size)
+#endif
 
 #define REPORT_LENGTH 1024
 
+// every IN report lives in one of these from write() to completion, so the
+// pool is also the transmit buffer; tx_reqs in configfs
+#define NUM_HID_IN_TRANSFERS 16
+#define MIN_HID_IN_TRANSFERS 4
+#define MAX_HID_IN_TRANSFERS 64
+
+// read fifo bytes, rx_buf_size in configfs, rounded up to a power of two
+#define HID_RX_BUF_SIZE (REPORT_LENGTH*4)
+// the largest record: a whole report or reassembled packet plus the
+// kfifo_rec_ptr_2 length header, anything smaller drops those forever
+#define MIN_HID_RX_BUF_SIZE (REPORT_LENGTH + 2)
+#define MAX_HID_RX_BUF_SIZE (64*1024)
+// requests handed to the UDC at a time: enough to keep the endpoint busy,
+// few enough that a high priority report doesn't wait behind a whole pool
+#define MAX_HID_IN_FLIGHT 2
+// idle requests bulk writers leave: one for high priority, one for the lane
+// finishing a packet on the wire
+#define HID_IN_HIGH_RESERVED 2
+#define NR_HID_TX_LANES 2
+
+// a deferred SET_REPORT this old may have been given up by the host: some
+// head units abort control transfers well before the 5 s USB 2.0 limit, and
+// queueing ep0_req after that would hand it to someone else's transfer
+#define HID_RX_DEFER_TIMEOUT_MS 500
+
+// flight recorder records, recorder_slots in configfs, 0 turns it off
+#define HID_REC_SLOTS 512
+#define MAX_HID_REC_SLOTS 8192
+
+// iAP over HID: every report is [report id][link control][data]
+#define IAP_LINK_CONTINUATION	0x01	// continues the previous report's packet
+#define IAP_LINK_MORE		0x02	// the packet goes on in the next report
+#define IAP_SOP			0x55
+#define IAP_LINGO_EXTENDED	0x04	// 16 bit command IDs
+// largest iAP packet: 0x55, 0x00, 16 bit length, payload, checksum
+#define IAP_MAX_PACKET		(4 + 0xffff + 1)
+
+#define MAX_HID_IN_REPORTS 16
+// exact plans for packets up to this size, bigger ones are first cut down
+// with the report that carries the most data per transaction
+#define HID_TX_PLAN_WINDOW 2048
+
+/*
+ * How to send packets over the Input reports of one report descriptor.
+ * step[n] is the cheapest way to send n bytes, step[n].report the report to
+ * start with.
+ */
+struct ipod_hid_tx_plan
+{
+	unsigned int nr_reports;
+	u8 id[MAX_HID_IN_REPORTS];
+	// data bytes after the report id, link control included
+	u16 size[MAX_HID_IN_REPORTS];
+	unsigned int bulk;
+	struct {
+		u16 trans;
+		u16 pad;
+		u8 report;
+	} step[HID_TX_PLAN_WINDOW + 1];
+};
+
 struct class *ipod_hid_class;
 
+struct ipod_hid_file;
+
+// kernel side of the mmap rings, see ipod_hid.h
+struct ipod_hid_ring
+{
+	void *mem;
+	size_t size;
+	struct ipod_hid_ring_ctl *ctl;
+	struct ipod_hid_ring_slot *rx;
+	struct ipod_hid_ring_slot *tx;
+	u32 rx_slots;
+	u32 tx_slots;
+	// our own copies, userspace can scribble over ctl
+	u32 rx_head;
+	u32 tx_tail;
+	// priority of the owning file
+	unsigned int lane;
+	struct ipod_hid_file *file;
+};
+
+// ipod_hid/iapN/
+static struct dentry *ipod_hid_debugfs_root;
+
+struct ipod_hid;
+
+/*
+ * One flight recorder record. seq is the record number + 1 once the record
+ * is complete and 0 while a writer fills it in, so a reader can tell a torn
+ * copy from a good one.
+ */
+struct ipod_hid_rec_slot {
+	u32 seq;
+	u16 len;
+	u16 orig_len;
+	u64 ts;
+	u8 data[IPOD_HID_REC_SNAPLEN];
+};
+
+// an IN request and when write() queued it, req->context points here
+struct ipod_hid_in_req {
+	struct usb_request *req;
+	struct ipod_hid *hid;
+	u64 queued_ns;
+};
+
 struct ipod_hid
 {
 	struct usb_function func;
@@ -35,7 +158,14 @@ struct ipod_hid
 	atomic_t refcnt;
 	bool bound;
 
-	struct mutex lock;
+	/*
+	 * Readers and writers never share a lock. read_fifo is single
+	 * producer/single consumer and the send side is guarded by send_lock:
+	 * the mutexes only serialize readers among themselves and writers of
+	 * the same priority among themselves.
+	 */
+	struct mutex read_lock;
+	struct mutex write_lock[NR_HID_TX_LANES];
 
 	int intf;
 	struct usb_ep *in_ep;
@@ -47,20 +177,128 @@ struct ipod_hid
 	struct cdev cdev;
 	// struct device *device;
 
-	
-	wait_queue_head_t waitq;
+	// data in read_fifo / a request on in_req_free
+	wait_queue_head_t read_waitq;
+	wait_queue_head_t write_waitq;
 
-	// recv
-	STRUCT_KFIFO_REC_2(REPORT_LENGTH*4) read_fifo;
+	// recv: read_fifo, read_buf and rx_pkt only exist while the device is
+	// open; swapped in and out under rx_lock
+	struct kfifo_rec_ptr_2 read_fifo;
+	unsigned int rx_buf_size;
 	//spinlock_t read_lock;
 
+	// packet mode: the ep0 completion joins fragments in rx_pkt
+	spinlock_t rx_lock;
+	u32 packet_mode;
+	bool rx_pkt_active;
+	unsigned int rx_pkt_len;
+	u8 *rx_pkt;
+	struct ipod_hid_packet_stats packet_stats;
+	// auto responder, also under rx_lock
+	// allocated on the first IPOD_HID_IOC_AUTO_SET
+	struct ipod_hid_auto_entry *auto_table;
+	u8 auto_buf[IPOD_HID_AUTO_MAX_RESPONSE];
+	// flow control, also under rx_lock. A deferred data stage goes on our
+	// own ep0 request so a late queue can't collide with cdev->req.
+	u32 rx_flow;
+	struct usb_request *ep0_req;
+	bool rx_deferred;
+	bool rx_ep0_queued;
+	unsigned long rx_deferred_at;
+	struct ipod_hid_rx_stats rx_stats;
+	// the rx_* half of stats is under rx_lock, the tx_* half under send_lock
+	struct ipod_hid_stats stats;
+	// a report went into an empty read fifo at this time, 0 once read
+	u64 rx_wake_ns;
+	// one report on its way from read_fifo to the reader, under read_lock
+	u8 *read_buf;
+	// serializes the first open and the last release
+	struct mutex open_lock;
+
 	// send
-	struct usb_request *in_req;
+	struct ipod_hid_in_req *in_req;
+	unsigned int nr_in_req;
+	// buffer size of each, the longest Input report with its id
+	unsigned int in_req_len;
+	// requests from in_req, linked through req->list: idle ones, and ones
+	// write() filled that wait for the endpoint, per priority in write order
+	struct list_head in_req_free;
+	unsigned int in_req_nfree;
+	struct list_head in_req_pending[NR_HID_TX_LANES];
+	unsigned int in_req_inflight;
+	bool in_ep_enabled;
+	// what the host enumerated at, USB_SPEED_UNKNOWN while not selected
+	enum usb_device_speed speed;
+	// per lane: the last report queued said more follows, nothing may cut in
+	bool tx_more[NR_HID_TX_LANES];
+	// the last report handed to the UDC said more follows, so its lane
+	// keeps the endpoint until the packet is complete
+	bool tx_sent_more;
+	unsigned int tx_sent_lane;
+	// file whose packet tx_more is waiting on, so its release can end it
+	struct ipod_hid_file *tx_owner[NR_HID_TX_LANES];
+	spinlock_t send_lock;
+
+	// packet mode TX, one plan per speed, the one in use picked by set_alt
+	struct ipod_hid_tx_plan *tx_plan_fs;
+	struct ipod_hid_tx_plan *tx_plan_hs;
+	struct ipod_hid_tx_plan *tx_plan;
+
+	// set by the file that owns the rings: RX is read under RCU by the
+	// ep0 completion, TX under send_lock
+	struct ipod_hid_ring __rcu *ring;
+
+	struct dentry *debugfs;
+
+	// flight recorder, fixed for the lifetime of the instance
+	struct ipod_hid_rec_slot *rec;
+	unsigned int rec_slots;
+	atomic_t rec_head;
+};
+
+/*
+ * Append a record. Writers run in both completion handlers at once, each
+ * claims its own slot with one atomic and never waits for anyone.
+ */
+static void ipod_hid_rec(struct ipod_hid *hid, u8 dir, const void *buf, unsigned int len)
+{
+	struct ipod_hid_rec_slot *slot;
+	u32 seq;
+
+	if (!hid->rec)
+		return;
 
-	STRUCT_KFIFO_REC_2(REPORT_LENGTH*4) write_fifo;
-	struct work_struct send_work;
-	struct completion  send_completion;
+	seq = atomic_inc_return(&hid->rec_head) - 1;
+	slot = &hid->rec[seq & (hid->rec_slots - 1)];
+	WRITE_ONCE(slot->seq, 0);
+	smp_wmb();
+	slot->ts = ktime_get_real_ns();
+	slot->orig_len = 1 + len;
+	slot->len = min_t(unsigned int, 1 + len, IPOD_HID_REC_SNAPLEN);
+	slot->data[0] = dir;
+	memcpy(slot->data + 1, buf, slot->len - 1);
+	smp_store_release(&slot->seq, seq + 1);
+}
+
+static void ipod_hid_rec_event(struct ipod_hid *hid, u8 event, u8 arg)
+{
+	u8 ev[2] = { event, arg };
+
+	ipod_hid_rec(hid, IPOD_HID_REC_EVENT, ev, sizeof(ev));
+}
+
+static inline unsigned int ipod_hid_hist_bucket(u64 ns)
+{
+	return min_t(unsigned int, fls64(ns), IPOD_HID_STATS_BUCKETS - 1);
+}
 
+// per open file of /dev/iapN
+struct ipod_hid_file
+{
+	struct ipod_hid *hid;
+	unsigned int read_mode;
+	unsigned int prio;
+	struct ipod_hid_ring *ring;
 };
 
 static inline struct ipod_hid *func_to_ipod_hid(struct usb_function *f)
@@ -75,33 +313,351 @@ static int ipod_mutex_lock(struct mutex *mutex, unsigned nonblock)
 		: mutex_lock_interruptible(mutex);
 }
 
-static void ipod_hid_recv_complete(struct usb_ep *ep, struct usb_request *req)
+// Returns false when nobody mapped the rings and the report goes to read_fifo.
+static bool ipod_hid_ring_rx(struct ipod_hid *hid, const void *buf, unsigned int len)
+{
+	struct ipod_hid_ring *ring;
+	struct ipod_hid_ring_slot *slot;
+	u32 tail;
+
+	rcu_read_lock();
+	ring = rcu_dereference(hid->ring);
+	if (!ring) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	// the slot at tail is free once userspace has stored the new tail
+	tail = smp_load_acquire(&ring->ctl->rx.tail);
+	if (ring->rx_head - tail >= ring->rx_slots) {
+		hid->rx_stats.dropped++;
+		trace_ipod_hid_rx_queue(len, true, ring->rx_head - tail, ring->rx_slots, true);
+		pr_err("recv ring full!\n");
+	} else if (len > sizeof(slot->data)) {
+		hid->rx_stats.dropped++;
+		hid->stats.rx_too_long++;
+		trace_ipod_hid_rx_queue(len, true, ring->rx_head - tail, ring->rx_slots, true);
+		pr_err_ratelimited("recv report too long for ring: %u\n", len);
+	} else {
+		slot = &ring->rx[ring->rx_head & (ring->rx_slots - 1)];
+		memcpy(slot->data, buf, len);
+		slot->len = len;
+		ring->rx_head++;
+		smp_store_release(&ring->ctl->rx.head, ring->rx_head);
+		trace_ipod_hid_rx_queue(len, true, ring->rx_head - tail, ring->rx_slots, false);
+		wake_up_interruptible(&hid->read_waitq);
+	}
+	rcu_read_unlock();
+	return true;
+}
+
+// Hand a report, or a whole packet in packet mode, to the reader.
+static void ipod_hid_rx_deliver(struct ipod_hid *hid, const void *buf, unsigned int len)
 {
-    struct ipod_hid *hid = req->context;
 	int copied;
-	trace_printk("len=%d actual=%d \n", req->length, req->actual);
-	copied = kfifo_in(&hid->read_fifo, req->buf, req->length);
-	if(unlikely(copied != req->length)) {
+
+	if (ipod_hid_ring_rx(hid, buf, len))
+		return;
+	// nobody has the device open
+	if (unlikely(!kfifo_initialized(&hid->read_fifo))) {
+		hid->rx_stats.dropped++;
+		trace_ipod_hid_rx_queue(len, false, 0, 0, true);
+		return;
+	}
+	// read() hands reports out through read_buf
+	if(unlikely(len > REPORT_LENGTH)) {
+		hid->rx_stats.dropped++;
+		hid->stats.rx_too_long++;
+		trace_ipod_hid_rx_queue(len, false, kfifo_len(&hid->read_fifo),
+			kfifo_size(&hid->read_fifo), true);
+		pr_err_ratelimited("recv report too long: %u\n", len);
+		return;
+	}
+	if (kfifo_is_empty(&hid->read_fifo))
+		hid->rx_wake_ns = ktime_get_ns();
+	copied = kfifo_in(&hid->read_fifo, buf, len);
+	trace_ipod_hid_rx_queue(len, false, kfifo_len(&hid->read_fifo),
+		kfifo_size(&hid->read_fifo), copied != len);
+	if(unlikely(copied != len)) {
+		hid->rx_stats.dropped++;
 		pr_err("recv buffer full!\n");
 		return;
 	}
-	wake_up_interruptible(&hid->waitq);
+	hid->rx_stats.fifo_high_water = max(hid->rx_stats.fifo_high_water,
+		kfifo_len(&hid->read_fifo));
+	hid->stats.rx_fifo_high_water = max(hid->stats.rx_fifo_high_water,
+		kfifo_len(&hid->read_fifo));
+	wake_up_interruptible(&hid->read_waitq);
 }
 
+// Length of the iAP packet at pkt without trailing padding, 0 if the header
+// doesn't fit in len.
+static unsigned int ipod_hid_packet_len(const u8 *pkt, unsigned int len)
+{
+	unsigned int total;
+
+	if (len < 2 || pkt[0] != IAP_SOP)
+		return 0;
+	if (pkt[1]) {
+		total = 2 + pkt[1] + 1;
+	} else {
+		// large packet: 0x00 then a 16 bit big endian length
+		if (len < 4)
+			return 0;
+		total = 4 + (pkt[2] << 8 | pkt[3]) + 1;
+	}
+	return total <= len ? total : 0;
+}
+
+// The checksum makes the bytes from the length field on sum up to zero.
+static u8 ipod_hid_packet_sum(const u8 *pkt, unsigned int total)
+{
+	unsigned int i;
+	u8 sum = 0;
+
+	for (i = 1; i < total; i++)
+		sum += pkt[i];
+	return sum;
+}
+
+/*
+ * Checks a reassembled packet and returns its length without the padding of
+ * the last report, or 0 if it's malformed.
+ */
+static unsigned int ipod_hid_packet_check(struct ipod_hid *hid, const u8 *pkt, unsigned int len)
+{
+	unsigned int total = ipod_hid_packet_len(pkt, len);
+
+	if (!total) {
+		hid->packet_stats.rx_bad_header++;
+		return 0;
+	}
+	if (ipod_hid_packet_sum(pkt, total)) {
+		hid->packet_stats.rx_bad_checksum++;
+		return 0;
+	}
+	return total;
+}
+
+static bool ipod_hid_auto_respond(struct ipod_hid *hid, const u8 *pkt, unsigned int len);
+
+// Called with rx_lock held.
+static void ipod_hid_rx_packet(struct ipod_hid *hid, const u8 *buf, unsigned int len)
+{
+	u8 link;
+	unsigned int total;
+
+	if (len < 2) {
+		hid->packet_stats.rx_bad_header++;
+		return;
+	}
+	link = buf[1];
+	buf += 2;
+	len -= 2;
+
+	if (!(link & IAP_LINK_CONTINUATION)) {
+		if (hid->rx_pkt_active)
+			hid->packet_stats.rx_bad_sequence++;
+		hid->rx_pkt_active = true;
+		hid->rx_pkt_len = 0;
+	} else if (!hid->rx_pkt_active) {
+		hid->packet_stats.rx_bad_sequence++;
+		return;
+	}
+
+	if (!hid->rx_pkt) {
+		hid->rx_stats.dropped++;
+		return;
+	}
+
+	if (hid->rx_pkt_len + len > REPORT_LENGTH) {
+		hid->packet_stats.rx_oversize++;
+		hid->rx_pkt_active = false;
+		return;
+	}
+	memcpy(hid->rx_pkt + hid->rx_pkt_len, buf, len);
+	hid->rx_pkt_len += len;
+
+	if (link & IAP_LINK_MORE)
+		return;
+
+	hid->rx_pkt_active = false;
+	total = ipod_hid_packet_check(hid, hid->rx_pkt, hid->rx_pkt_len);
+	if (!total)
+		return;
+	hid->packet_stats.rx_packets++;
+	if (ipod_hid_auto_respond(hid, hid->rx_pkt, total))
+		return;
+	ipod_hid_rx_deliver(hid, hid->rx_pkt, total);
+}
+
+static void ipod_hid_recv_complete(struct usb_ep *ep, struct usb_request *req)
+{
+    struct ipod_hid *hid = req->context;
+	unsigned long flags;
+	unsigned int total;
+	const u8 *buf;
+	trace_ipod_hid_rx_report(req);
+
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	if (req == hid->ep0_req)
+		hid->rx_ep0_queued = false;
+	// the host gave up on the transfer or the bus was reset: whatever is
+	// in the buffer is stale
+	if (req->status || !req->actual) {
+		pr_debug("recv: dropped, status=%d actual=%u\n", req->status, req->actual);
+		goto unlock;
+	}
+
+	buf = req->buf;
+	ipod_hid_rec(hid, IPOD_HID_REC_RX, buf, req->actual);
+	hid->stats.rx_reports++;
+	hid->stats.rx_bytes += req->actual;
+	if (buf[0] < IPOD_HID_STATS_IDS) {
+		hid->stats.rx_reports_id[buf[0]]++;
+		hid->stats.rx_bytes_id[buf[0]] += req->actual;
+	}
+
+	if (hid->packet_mode & IPOD_HID_PACKET_RX) {
+		ipod_hid_rx_packet(hid, req->buf, req->actual);
+	} else {
+		// a single report packet can still be answered in place
+		if (req->actual > 2 && buf[1] == 0) {
+			total = ipod_hid_packet_len(buf + 2, req->actual - 2);
+			if (total && !ipod_hid_packet_sum(buf + 2, total) &&
+				ipod_hid_auto_respond(hid, buf + 2, total))
+				goto unlock;
+		}
+		ipod_hid_rx_deliver(hid, req->buf, req->actual);
+	}
+unlock:
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+}
+
+// Room for a len byte report. Called with rx_lock held.
+static bool ipod_hid_rx_room(struct ipod_hid *hid, unsigned int len)
+{
+	struct ipod_hid_ring *ring;
+	bool room;
+
+	rcu_read_lock();
+	ring = rcu_dereference(hid->ring);
+	if (ring)
+		room = ring->rx_head - smp_load_acquire(&ring->ctl->rx.tail) < ring->rx_slots;
+	else if (!kfifo_initialized(&hid->read_fifo))
+		room = true;
+	else
+		room = kfifo_avail(&hid->read_fifo) >= len;
+	rcu_read_unlock();
+	return room;
+}
+
+/*
+ * SET_REPORT setup: in IPOD_HID_RX_DEFER mode with no room for the report,
+ * park the data stage on ep0_req and tell the caller not to queue anything.
+ */
+static bool ipod_hid_rx_defer(struct ipod_hid *hid, unsigned int len)
+{
+	struct usb_request *req = hid->ep0_req;
+	unsigned long flags;
+	bool defer = false;
+
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	// a new SETUP means the host gave up on the one we held back
+	if (hid->rx_deferred) {
+		hid->rx_deferred = false;
+		hid->rx_stats.expired++;
+	}
+	if (hid->rx_flow == IPOD_HID_RX_DEFER && req && !hid->rx_ep0_queued &&
+		len <= REPORT_LENGTH && !ipod_hid_rx_room(hid, len)) {
+		req->zero = 0;
+		req->length = len;
+		req->context = hid;
+		req->complete = ipod_hid_recv_complete;
+		hid->rx_deferred = true;
+		hid->rx_deferred_at = jiffies;
+		hid->rx_stats.deferred++;
+		defer = true;
+	}
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+	return defer;
+}
+
+// Forget a held back data stage, the transfer it belonged to is gone.
+static void ipod_hid_rx_defer_cancel(struct ipod_hid *hid)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	if (hid->rx_deferred) {
+		hid->rx_deferred = false;
+		hid->rx_stats.expired++;
+	}
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+}
+
+// The reader made room: let a held back data stage through.
+static void ipod_hid_rx_resume(struct ipod_hid *hid)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	if (!hid->rx_deferred)
+		goto unlock;
+	if (time_after(jiffies, hid->rx_deferred_at +
+		msecs_to_jiffies(HID_RX_DEFER_TIMEOUT_MS)) || !hid->bound) {
+		hid->rx_deferred = false;
+		hid->rx_stats.expired++;
+		goto unlock;
+	}
+	if (hid->rx_flow == IPOD_HID_RX_DEFER &&
+		!ipod_hid_rx_room(hid, hid->ep0_req->length))
+		goto unlock;
+
+	hid->rx_deferred = false;
+	hid->rx_ep0_queued = true;
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+
+	// outside rx_lock, the completion takes it
+	ret = usb_ep_queue(hid->func.config->cdev->gadget->ep0, hid->ep0_req, GFP_ATOMIC);
+	if (ret) {
+		pr_err("usb_ep_queue error on ep0 %d\n", ret);
+		spin_lock_irqsave(&hid->rx_lock, flags);
+		hid->rx_ep0_queued = false;
+		spin_unlock_irqrestore(&hid->rx_lock, flags);
+	}
+	return;
+
+unlock:
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+}
 
-static ssize_t ipod_hid_dev_read(struct file *file, char __user *buffer,
-								 size_t count, loff_t *ptr)
+/*
+ * Backs both read() and readv(). IPOD_HID_READ_REPORT returns a single
+ * report; IPOD_HID_READ_FRAMED keeps draining read_fifo as long as the next
+ * length prefixed report fits, so a burst of SET_REPORTs costs one call.
+ */
+static ssize_t ipod_hid_dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    struct ipod_hid *hid = file->private_data;
+	struct file *file = iocb->ki_filp;
+	struct ipod_hid_file *hf = file->private_data;
+	struct ipod_hid *hid = hf->hid;
+	bool framed = READ_ONCE(hf->read_mode) == IPOD_HID_READ_FRAMED;
+	size_t count = iov_iter_count(to);
+	unsigned long flags;
+	size_t need;
+	ssize_t copied = 0;
 	int ret = -EINVAL;
-	int n, copied;
+	u16 n;
 
 	if (!count)
 		return 0;
+	// SET_REPORTs go to the ring, the fifo stays empty
+	if (rcu_access_pointer(hid->ring))
+		return -EBUSY;
 
-	trace_printk("len=%zu\n", count);
-
-	ret = ipod_mutex_lock(&hid->lock, file->f_flags & O_NONBLOCK);
+	ret = ipod_mutex_lock(&hid->read_lock, file->f_flags & O_NONBLOCK);
 	if(ret) {
 		return ret;
 	}
@@ -112,7 +668,7 @@ static ssize_t ipod_hid_dev_read(struct file *file, char __user *buffer,
 			ret = -EAGAIN;
 			goto unlock;
 		}
-		ret = wait_event_interruptible(hid->waitq,
+		ret = wait_event_interruptible(hid->read_waitq,
 			!kfifo_is_empty(&hid->read_fifo));
 
 		if(ret) {
@@ -120,180 +676,1234 @@ static ssize_t ipod_hid_dev_read(struct file *file, char __user *buffer,
 		}
 	}
 
-	n = kfifo_peek_len(&hid->read_fifo);
-	if(count < n) {
-		ret = -EFAULT;
-		goto unlock;
+	do {
+		n = kfifo_peek_len(&hid->read_fifo);
+		need = framed ? sizeof(n) + n : n;
+		if (count - copied < need)
+			break;
+
+		n = kfifo_out(&hid->read_fifo, hid->read_buf, REPORT_LENGTH);
+		if (framed && copy_to_iter(&n, sizeof(n), to) != sizeof(n))
+			break;
+		if (copy_to_iter(hid->read_buf, n, to) != n)
+			break;
+		copied += need;
+	} while (framed && !kfifo_is_empty(&hid->read_fifo));
+
+	// not even the first report fit
+	ret = copied ? copied : -EFAULT;
+
+	if (copied) {
+		spin_lock_irqsave(&hid->rx_lock, flags);
+		if (hid->rx_wake_ns) {
+			hid->stats.rx_latency[ipod_hid_hist_bucket(
+				ktime_get_ns() - hid->rx_wake_ns)]++;
+			hid->rx_wake_ns = 0;
+		}
+		spin_unlock_irqrestore(&hid->rx_lock, flags);
 	}
 
-	ret = kfifo_to_user(&hid->read_fifo, buffer, count, &copied);
-	if(ret) {
+unlock:
+	trace_ipod_hid_read(count, ret, kfifo_initialized(&hid->read_fifo) ?
+		kfifo_len(&hid->read_fifo) : 0);
+	mutex_unlock(&hid->read_lock);
+	if (ret > 0)
+		ipod_hid_rx_resume(hid);
+	return ret;
+}
+
+static void ipod_hid_send_complete(struct usb_ep *ep, struct usb_request *req);
+
+// Called with send_lock held, for every report in write order.
+static void ipod_hid_add_pending(struct ipod_hid *hid, struct usb_request *req, unsigned int lane)
+{
+	struct ipod_hid_in_req *ctx = req->context;
+	const u8 *buf = req->buf;
+
+	ctx->queued_ns = ktime_get_ns();
+	hid->tx_more[lane] = req->length >= 2 && (buf[1] & IAP_LINK_MORE);
+	list_add_tail(&req->list, &hid->in_req_pending[lane]);
+	hid->stats.tx_queue_high_water = max(hid->stats.tx_queue_high_water,
+		hid->nr_in_req - hid->in_req_nfree);
+}
+
+/*
+ * Idle requests a lane has to leave to the others. The lane finishing a
+ * packet on the wire may take the last one, otherwise the other lane could
+ * fill the pool with reports that aren't allowed out yet.
+ */
+static unsigned int ipod_hid_free_floor(struct ipod_hid *hid, unsigned int lane)
+{
+	if (hid->tx_sent_more && hid->tx_sent_lane == lane)
+		return 0;
+	return lane == IPOD_HID_PRIO_HIGH ? 1 : HID_IN_HIGH_RESERVED;
+}
+
+// Called with send_lock held.
+static struct usb_request *ipod_hid_take_free(struct ipod_hid *hid, unsigned int lane)
+{
+	struct usb_request *req;
+
+	if (hid->in_req_nfree <= ipod_hid_free_floor(hid, lane))
+		return NULL;
+	req = list_first_entry(&hid->in_req_free, struct usb_request, list);
+	list_del(&req->list);
+	hid->in_req_nfree--;
+	return req;
+}
+
+// Called with send_lock held.
+static void ipod_hid_give_free(struct ipod_hid *hid, struct usb_request *req)
+{
+	list_add(&req->list, &hid->in_req_free);
+	hid->in_req_nfree++;
+}
+
+/*
+ * Move posted TX ring slots onto idle requests, behind whatever write()
+ * queued before. Called with send_lock held.
+ */
+static void ipod_hid_ring_tx(struct ipod_hid *hid)
+{
+	struct ipod_hid_ring *ring;
+	struct ipod_hid_ring_slot *slot;
+	struct usb_request *req;
+	u32 head;
+	u32 len;
+
+	ring = rcu_dereference_protected(hid->ring, lockdep_is_held(&hid->send_lock));
+	if (!ring)
+		return;
+
+	head = smp_load_acquire(&ring->ctl->tx.head);
+	if (head == ring->tx_tail || head - ring->tx_tail > ring->tx_slots)
+		return;
+
+	while (ring->tx_tail != head) {
+		slot = &ring->tx[ring->tx_tail & (ring->tx_slots - 1)];
+
+		len = READ_ONCE(slot->len);
+		if (len > sizeof(slot->data) || len > hid->in_req_len) {
+			pr_err("send ring slot too long: %u\n", len);
+			ring->tx_tail++;
+			continue;
+		}
+
+		// a write() on this lane is between the reports of a packet
+		if (hid->tx_more[ring->lane] && hid->tx_owner[ring->lane] != ring->file)
+			break;
+		req = ipod_hid_take_free(hid, ring->lane);
+		if (!req)
+			break;
+		ring->tx_tail++;
+		memcpy(req->buf, slot->data, len);
+
+		req->status = 0;
+		req->zero = 0;
+		req->length = len;
+		req->complete = ipod_hid_send_complete;
+		ipod_hid_add_pending(hid, req, ring->lane);
+		hid->tx_owner[ring->lane] = hid->tx_more[ring->lane] ? ring->file : NULL;
+	}
+	smp_store_release(&ring->ctl->tx.tail, ring->tx_tail);
+}
+
+/*
+ * Lane of the next report to send. High priority goes first, but only
+ * between iAP packets: a packet that is partly on the wire finishes first,
+ * even if its lane has to wait for the writer. -1 if there's nothing to send.
+ */
+static int ipod_hid_next_lane(struct ipod_hid *hid)
+{
+	if (hid->tx_sent_more)
+		return list_empty(&hid->in_req_pending[hid->tx_sent_lane])
+			? -1 : hid->tx_sent_lane;
+	if (!list_empty(&hid->in_req_pending[IPOD_HID_PRIO_HIGH]))
+		return IPOD_HID_PRIO_HIGH;
+	if (!list_empty(&hid->in_req_pending[IPOD_HID_PRIO_BULK]))
+		return IPOD_HID_PRIO_BULK;
+	return -1;
+}
+
+/*
+ * Hand the filled requests to the UDC, each lane in write order and no more
+ * than MAX_HID_IN_FLIGHT at a time. Called with send_lock held; a request
+ * the UDC refuses stays at the head of its lane until the endpoint is
+ * enabled again.
+ */
+static void ipod_hid_send_pump(struct ipod_hid *hid)
+{
+	struct usb_request *req;
+	const u8 *buf;
+	int lane;
+	int ret;
+
+	ipod_hid_ring_tx(hid);
+
+	while (hid->in_ep_enabled && hid->in_req_inflight < MAX_HID_IN_FLIGHT) {
+		lane = ipod_hid_next_lane(hid);
+		if (lane < 0)
+			break;
+		req = list_first_entry(&hid->in_req_pending[lane], struct usb_request, list);
+		list_del(&req->list);
+
+		ret = usb_ep_queue(hid->in_ep, req, GFP_ATOMIC);
+		if(ret) {
+			pr_err("usb_ep_queue error=%d\n", ret);
+			list_add(&req->list, &hid->in_req_pending[lane]);
+			break;
+		}
+		hid->in_req_inflight++;
+		trace_ipod_hid_tx_report(req, hid->in_req_inflight, hid->in_req_nfree);
+		buf = req->buf;
+		hid->tx_sent_more = req->length >= 2 && (buf[1] & IAP_LINK_MORE);
+		hid->tx_sent_lane = lane;
+	}
+}
+
+// Sent a report
+static void ipod_hid_send_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct ipod_hid_in_req *ctx = req->context;
+	struct ipod_hid *hid = ctx->hid;
+	const u8 *buf = req->buf;
+	unsigned long flags;
+
+	// the request can take the next TX ring slot right away
+	spin_lock_irqsave(&hid->send_lock, flags);
+	hid->in_req_inflight--;
+	if (!req->status) {
+		ipod_hid_rec(hid, IPOD_HID_REC_TX, buf, req->actual);
+		hid->stats.tx_reports++;
+		hid->stats.tx_bytes += req->actual;
+		if (buf[0] < IPOD_HID_STATS_IDS) {
+			hid->stats.tx_reports_id[buf[0]]++;
+			hid->stats.tx_bytes_id[buf[0]] += req->actual;
+		}
+		hid->stats.tx_latency[ipod_hid_hist_bucket(
+			ktime_get_ns() - ctx->queued_ns)]++;
+	}
+	trace_ipod_hid_tx_done(req, hid->in_req_inflight, hid->in_req_nfree);
+	ipod_hid_give_free(hid, req);
+	ipod_hid_send_pump(hid);
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+
+	wake_up_interruptible(&hid->write_waitq);
+}
+
+static struct usb_request *ipod_hid_get_req(struct ipod_hid *hid, unsigned int lane,
+	struct ipod_hid_file *hf)
+{
+	struct usb_request *req = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hid->send_lock, flags);
+	// the TX ring of another file is between the reports of a packet
+	if (!hid->tx_more[lane] || !hid->tx_owner[lane] || hid->tx_owner[lane] == hf)
+		req = ipod_hid_take_free(hid, lane);
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+
+	return req;
+}
+
+/*
+ * Takes an idle request, sleeping for one unless nonblock. In the middle of a
+ * packet only a fatal signal stops the wait, a half sent packet would throw
+ * the dock out of sync.
+ */
+static int ipod_hid_wait_req(struct ipod_hid *hid, struct ipod_hid_file *hf, unsigned int lane,
+	bool nonblock, bool midpacket, struct usb_request **reqp)
+{
+	struct usb_request *req;
+	int ret;
+
+	req = ipod_hid_get_req(hid, lane, hf);
+	if (!req) {
+		if (nonblock && !midpacket)
+			return -EAGAIN;
+		// unbind clears bound and waits for write_lock
+		if (midpacket)
+			ret = wait_event_killable(hid->write_waitq,
+				(req = ipod_hid_get_req(hid, lane, hf)) || !READ_ONCE(hid->bound));
+		else
+			ret = wait_event_interruptible(hid->write_waitq,
+				(req = ipod_hid_get_req(hid, lane, hf)) || !READ_ONCE(hid->bound));
+		if(ret) {
+			return ret;
+		}
+		if (!req) {
+			return -ESHUTDOWN;
+		}
+	}
+
+	*reqp = req;
+	return 0;
+}
+
+static void ipod_hid_put_req(struct ipod_hid *hid, struct usb_request *req)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hid->send_lock, flags);
+	ipod_hid_give_free(hid, req);
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+}
+
+static void ipod_hid_queue_req(struct ipod_hid *hid, struct usb_request *req, unsigned int len,
+	unsigned int lane, struct ipod_hid_file *hf)
+{
+	unsigned long flags;
+
+	req->status = 0;
+	req->zero = 0;
+	req->length = len;
+	req->complete = ipod_hid_send_complete;
+
+	spin_lock_irqsave(&hid->send_lock, flags);
+	ipod_hid_add_pending(hid, req, lane);
+	hid->tx_owner[lane] = hid->tx_more[lane] ? hf : NULL;
+	ipod_hid_send_pump(hid);
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+}
+
+// Report to carry the next part of a packet with len bytes left.
+static unsigned int ipod_hid_plan_next(const struct ipod_hid_tx_plan *plan, size_t len)
+{
+	if (len > HID_TX_PLAN_WINDOW)
+		return plan->bulk;
+	return plan->step[len].report;
+}
+
+/*
+ * Lays out the report that carries the packet bytes from off on: report id,
+ * link control and padding. The caller puts *chunk bytes of data at buf + 2.
+ * Returns the report length.
+ */
+static unsigned int ipod_hid_plan_fragment(const struct ipod_hid_tx_plan *plan, u8 *buf,
+	size_t off, size_t count, size_t *chunk)
+{
+	unsigned int r = ipod_hid_plan_next(plan, count - off);
+
+	*chunk = min_t(size_t, plan->size[r] - 1, count - off);
+	buf[0] = plan->id[r];
+	buf[1] = (off ? IAP_LINK_CONTINUATION : 0) |
+		(off + *chunk < count ? IAP_LINK_MORE : 0);
+	memset(buf + 2 + *chunk, 0, plan->size[r] - 1 - *chunk);
+	return 1 + plan->size[r];
+}
+
+/*
+ * A writer left lane in the middle of a packet (signal, fault, close), and
+ * until that packet ends nothing else may use the endpoint. End it: clear
+ * more-follows on the last report that hasn't gone out yet, or if they all
+ * have, send an empty continuation. The host drops the short packet on its
+ * checksum. With hf set, only if the unfinished packet is hf's.
+ */
+static void ipod_hid_abort_packet(struct ipod_hid *hid, unsigned int lane,
+	struct ipod_hid_file *hf)
+{
+	struct usb_request *req;
+	unsigned long flags;
+	size_t chunk;
+	unsigned int len;
+	u8 *buf;
+
+	spin_lock_irqsave(&hid->send_lock, flags);
+	if (!hid->tx_more[lane] || (hf && hid->tx_owner[lane] != hf))
+		goto unlock;
+	hid->tx_more[lane] = false;
+	hid->tx_owner[lane] = NULL;
+
+	if (!list_empty(&hid->in_req_pending[lane])) {
+		req = list_last_entry(&hid->in_req_pending[lane], struct usb_request, list);
+		buf = req->buf;
+		buf[1] &= ~IAP_LINK_MORE;
 		goto unlock;
 	}
-	if(WARN_ON(copied != n)) {
-		ret = -EFAULT;
+
+	// past the reserve floors, this is what the reserve is for
+	if (hid->tx_plan && hid->in_req_nfree) {
+		req = list_first_entry(&hid->in_req_free, struct usb_request, list);
+		list_del(&req->list);
+		hid->in_req_nfree--;
+		len = ipod_hid_plan_fragment(hid->tx_plan, req->buf, 1, 1, &chunk);
+		req->status = 0;
+		req->zero = 0;
+		req->length = len;
+		req->complete = ipod_hid_send_complete;
+		ipod_hid_add_pending(hid, req, lane);
+		ipod_hid_send_pump(hid);
 		goto unlock;
 	}
-	ret = copied;
+
+	// no way to tell the host, just stop holding the endpoint
+	if (hid->tx_sent_lane == lane)
+		hid->tx_sent_more = false;
+	ipod_hid_send_pump(hid);
 
 unlock:
-	mutex_unlock(&hid->lock);
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+	wake_up_interruptible(&hid->write_waitq);
+}
+
+// Packet mode write(): split one iAP packet over IN reports.
+static ssize_t ipod_hid_write_packet(struct ipod_hid_file *hf, unsigned int lane,
+	const char __user *buffer, size_t count, bool nonblock)
+{
+	struct ipod_hid *hid = hf->hid;
+	const struct ipod_hid_tx_plan *plan = READ_ONCE(hid->tx_plan);
+	struct usb_request *req;
+	size_t off = 0;
+	size_t chunk;
+	unsigned int len;
+	int ret;
+
+	/*
+	 * Until the host selects the interface it is unknown which report map
+	 * it got, so wait for the plan the way raw writes wait for a request.
+	 */
+	if (!plan) {
+		if (nonblock)
+			return -EAGAIN;
+		// unbind clears bound and waits for write_lock
+		ret = wait_event_interruptible(hid->write_waitq,
+			(plan = READ_ONCE(hid->tx_plan)) || !READ_ONCE(hid->bound));
+		if (ret)
+			return ret;
+		if (!plan)
+			return -ESHUTDOWN;
+	}
+
+	while (off < count) {
+		ret = ipod_hid_wait_req(hid, hf, lane, nonblock, off > 0, &req);
+		if (ret)
+			goto abort;
+
+		len = ipod_hid_plan_fragment(plan, req->buf, off, count, &chunk);
+		// straight from user memory, as for single reports
+		if (copy_from_user((u8 *)req->buf + 2, buffer + off, chunk)) {
+			ipod_hid_put_req(hid, req);
+			ret = -EFAULT;
+			goto abort;
+		}
+
+		ipod_hid_queue_req(hid, req, len, lane, hf);
+		off += chunk;
+	}
+
+	return count;
+
+abort:
+	if (off)
+		ipod_hid_abort_packet(hid, lane, NULL);
 	return ret;
 }
 
-// Sent a report
-static void ipod_hid_send_complete(struct usb_ep *ep, struct usb_request *req)
+/*
+ * Queue a packet from kernel memory at high priority in one go, or nothing
+ * at all: not between the reports of another high priority packet and not
+ * unless there are enough idle requests for all of it. Called with
+ * send_lock held.
+ */
+static bool ipod_hid_send_packet_locked(struct ipod_hid *hid, const u8 *pkt, size_t count)
 {
-	struct ipod_hid *hid = req->context;
-    complete(&hid->send_completion);
+	const unsigned int lane = IPOD_HID_PRIO_HIGH;
+	const struct ipod_hid_tx_plan *plan = hid->tx_plan;
+	struct usb_request *req;
+	unsigned int n = 0, len;
+	size_t off, chunk;
+
+	if (!plan || hid->tx_more[lane])
+		return false;
+
+	for (off = 0; off < count; off += chunk, n++)
+		chunk = min_t(size_t, plan->size[ipod_hid_plan_next(plan, count - off)] - 1,
+			count - off);
+	if (hid->in_req_nfree < ipod_hid_free_floor(hid, lane) + n)
+		return false;
+
+	for (off = 0; off < count; off += chunk) {
+		req = ipod_hid_take_free(hid, lane);
+		len = ipod_hid_plan_fragment(plan, req->buf, off, count, &chunk);
+		memcpy((u8 *)req->buf + 2, pkt + off, chunk);
+
+		req->status = 0;
+		req->zero = 0;
+		req->length = len;
+		req->complete = ipod_hid_send_complete;
+		ipod_hid_add_pending(hid, req, lane);
+	}
+	ipod_hid_send_pump(hid);
+	return true;
 }
 
-static void ipod_hid_send_workfn(struct work_struct *work) {
-	struct ipod_hid* hid = container_of(work, struct ipod_hid, send_work);
-	int ret;
-	int len;
-	trace_printk("started\n");
-	while((len = kfifo_out(&hid->write_fifo,hid->in_req->buf, REPORT_LENGTH)) > 0) {
-		trace_printk("send len=%d\n", len);
-		//msleep(1000);
-		#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
-		reinit_completion(&hid->send_completion);
-		#else
-		INIT_COMPLETION(hid->send_completion);
-		#endif
-
-		hid->in_req->status = 0;
-		hid->in_req->zero = 0;
-		hid->in_req->length = len;
-		hid->in_req->context = hid;
-		hid->in_req->complete = ipod_hid_send_complete;
-
-		ret = usb_ep_queue(hid->in_ep, hid->in_req, GFP_ATOMIC);
-		if(ret) {
-			pr_err("usb_ep_queue error=%d\n", ret);
+/*
+ * Look a validated packet up in the auto responder table and answer it.
+ * Called with rx_lock held, from the ep0 completion.
+ */
+static bool ipod_hid_auto_respond(struct ipod_hid *hid, const u8 *pkt, unsigned int len)
+{
+	struct ipod_hid_auto_entry *e;
+	const u8 *body, *data;
+	unsigned int hdr, blen, dlen, cmd_len, skip, i;
+	unsigned long flags;
+	u16 cmd;
+	u8 *resp;
+	bool sent;
+
+	hdr = pkt[1] ? 2 : 4;
+	body = pkt + hdr;
+	// lingo, command, payload; no checksum
+	blen = len - hdr - 1;
+	if (blen < 2)
+		return false;
+	cmd_len = body[0] == IAP_LINGO_EXTENDED ? 2 : 1;
+	if (blen < 1 + cmd_len)
+		return false;
+	cmd = cmd_len == 2 ? body[1] << 8 | body[2] : body[1];
+	data = body + 1 + cmd_len;
+	dlen = blen - 1 - cmd_len;
+
+	if (!hid->auto_table)
+		return false;
+
+	for (i = 0; i < IPOD_HID_AUTO_MAX_ENTRIES; i++) {
+		e = &hid->auto_table[i];
+		if (!e->response_len || e->lingo != body[0] || e->cmd != cmd)
+			continue;
+		skip = e->flags & IPOD_HID_AUTO_ECHO_TRANS ? 2 : 0;
+		if (dlen < skip + e->match_len ||
+			memcmp(data + skip, e->match, e->match_len))
 			continue;
+
+		resp = hid->auto_buf;
+		memcpy(resp, e->response, e->response_len);
+		if (skip) {
+			// right after the command, which is as long as the request's
+			memcpy(resp + (resp[1] ? 2 : 4) + 1 + cmd_len, data, 2);
 		}
+		resp[e->response_len - 1] = 0;
+		resp[e->response_len - 1] = -ipod_hid_packet_sum(resp, e->response_len);
+
+		spin_lock_irqsave(&hid->send_lock, flags);
+		sent = ipod_hid_send_packet_locked(hid, resp, e->response_len);
+		spin_unlock_irqrestore(&hid->send_lock, flags);
+		if (!sent)
+			return false;
+		hid->packet_stats.rx_auto_answered++;
+		return true;
+	}
+	return false;
+}
+
+static int ipod_hid_auto_table_alloc(struct ipod_hid *hid)
+{
+	struct ipod_hid_auto_entry *table;
+	unsigned long flags;
 
-		wait_for_completion(&hid->send_completion);
+	table = kcalloc(IPOD_HID_AUTO_MAX_ENTRIES, sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
 
-		wake_up_interruptible(&hid->waitq);
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	if (!hid->auto_table) {
+		hid->auto_table = table;
+		table = NULL;
 	}
-	trace_printk("done\n");
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+	kfree(table);
+	return 0;
 }
 
+// Checks an entry from userspace against the packet it answers.
+static int ipod_hid_auto_check(const struct ipod_hid_auto_entry *e)
+{
+	unsigned int hdr, cmd_len;
 
+	if (e->slot >= IPOD_HID_AUTO_MAX_ENTRIES || e->flags & ~IPOD_HID_AUTO_ECHO_TRANS)
+		return -EINVAL;
+	if (!e->response_len)
+		return 0;
+	if (e->match_len > IPOD_HID_AUTO_MAX_MATCH ||
+		e->response_len > IPOD_HID_AUTO_MAX_RESPONSE ||
+		ipod_hid_packet_len(e->response, e->response_len) != e->response_len)
+		return -EINVAL;
+	if (e->flags & IPOD_HID_AUTO_ECHO_TRANS) {
+		// room for the transaction id where the request has it
+		hdr = e->response[1] ? 2 : 4;
+		cmd_len = e->lingo == IAP_LINGO_EXTENDED ? 2 : 1;
+		if (e->response_len < hdr + 1 + cmd_len + 2 + 1)
+			return -EINVAL;
+	}
+	return 0;
+}
 
 static ssize_t ipod_hid_dev_write(struct file *file, const char __user *buffer, size_t count, loff_t *offp)
 {
-	struct ipod_hid *hid = file->private_data;
-    int ret;
-	int copied;
-	bool was_scheduled;
+	struct ipod_hid_file *hf = file->private_data;
+	struct ipod_hid *hid = hf->hid;
+	struct usb_request *req;
+	bool packet = READ_ONCE(hid->packet_mode) & IPOD_HID_PACKET_TX;
+	unsigned int lane = READ_ONCE(hf->prio);
+	int ret;
+
+	trace_ipod_hid_write(count, lane, packet);
 
-	trace_printk("len=%zu\n", count);
+	if (count > (packet ? IAP_MAX_PACKET : REPORT_LENGTH))
+		return -EINVAL;
 
-	ret = ipod_mutex_lock(&hid->lock, file->f_flags & O_NONBLOCK);
+	ret = ipod_mutex_lock(&hid->write_lock[lane], file->f_flags & O_NONBLOCK);
 	if(ret) {
 		return ret;
 	}
 
-	if (kfifo_avail(&hid->write_fifo) < count) {
-		if (file->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto unlock;
-		}
-		ret = wait_event_interruptible(hid->waitq,
-			kfifo_avail(&hid->write_fifo) >= count);
-		if(ret) {
-			goto unlock;
-		}
+	if (packet) {
+		ret = ipod_hid_write_packet(hf, lane, buffer, count, file->f_flags & O_NONBLOCK);
+		goto unlock;
 	}
 
-	ret = kfifo_from_user(&hid->write_fifo, buffer, count, &copied);
-	if(ret) {
+	ret = ipod_hid_wait_req(hid, hf, lane, file->f_flags & O_NONBLOCK, false, &req);
+	if (ret)
+		goto unlock;
+
+	if (count > hid->in_req_len) {
+		ipod_hid_put_req(hid, req);
+		ret = -EINVAL;
 		goto unlock;
 	}
-	if(copied != count) {
-		pr_err("send buffer full!\n");
+
+	// the only copy: user memory straight into the request buffer
+	if (copy_from_user(req->buf, buffer, count)) {
+		ipod_hid_put_req(hid, req);
 		ret = -EFAULT;
 		goto unlock;
 	}
 
+	ipod_hid_queue_req(hid, req, count, lane, hf);
 	ret = count;
-	trace_printk("fifo len: %d\n", kfifo_len(&hid->write_fifo));
-
-	was_scheduled = schedule_work(&hid->send_work);
-	trace_printk("schedule=%d\n", was_scheduled);
 
 unlock:
-	mutex_unlock(&hid->lock);
+	mutex_unlock(&hid->write_lock[lane]);
 	return ret;
 }
 
 static unsigned int ipod_hid_dev_poll(struct file *file, poll_table *wait) {
-    struct ipod_hid *hid = file->private_data;
+	struct ipod_hid_file *hf = file->private_data;
+	struct ipod_hid *hid = hf->hid;
+	struct ipod_hid_ring *ring = hf->ring;
+	unsigned long flags;
 	unsigned int ret = 0;
 	
 
-	poll_wait(file, &hid->waitq, wait);
+	poll_wait(file, &hid->read_waitq, wait);
+	poll_wait(file, &hid->write_waitq, wait);
+
+	if (ring) {
+		// doubles as the TX doorbell, and lets a held back SET_REPORT in
+		spin_lock_irqsave(&hid->send_lock, flags);
+		ipod_hid_send_pump(hid);
+		spin_unlock_irqrestore(&hid->send_lock, flags);
+		ipod_hid_rx_resume(hid);
+
+		if (READ_ONCE(ring->ctl->rx.head) != READ_ONCE(ring->ctl->rx.tail))
+			ret |= POLLIN | POLLRDNORM;
+		if (READ_ONCE(ring->ctl->tx.head) - READ_ONCE(ring->ctl->tx.tail) < ring->tx_slots)
+			ret |= POLLOUT | POLLWRNORM;
+		return ret;
+	}
 
 	if (!kfifo_is_empty(&hid->read_fifo))
 		ret |= POLLIN | POLLRDNORM;
 
-	if (kfifo_avail(&hid->write_fifo))
+	// packet writes can't be split up before the host picked a report map
+	if ((!(READ_ONCE(hid->packet_mode) & IPOD_HID_PACKET_TX) || READ_ONCE(hid->tx_plan)) &&
+		READ_ONCE(hid->in_req_nfree) > (READ_ONCE(hf->prio) == IPOD_HID_PRIO_HIGH
+		? 1 : HID_IN_HIGH_RESERVED))
 		ret |= POLLOUT | POLLWRNORM;
 
-	trace_printk("read:%d write:%d\n", !!(ret & POLLIN), !!(ret & POLLOUT));
+	return ret;
+}
+
+static int ipod_hid_ring_setup(struct ipod_hid_file *hf, struct ipod_hid_ring_setup __user *argp)
+{
+	struct ipod_hid *hid = hf->hid;
+	struct ipod_hid_ring_setup setup;
+	struct ipod_hid_ring *ring;
+	unsigned long flags;
+	size_t rx_offset, tx_offset;
+	int ret = 0;
+
+	if (copy_from_user(&setup, argp, sizeof(setup)))
+		return -EFAULT;
+	if (!setup.rx_slots || setup.rx_slots > IPOD_HID_RING_MAX_SLOTS ||
+		!is_power_of_2(setup.rx_slots))
+		return -EINVAL;
+	if (!setup.tx_slots || setup.tx_slots > IPOD_HID_RING_MAX_SLOTS ||
+		!is_power_of_2(setup.tx_slots))
+		return -EINVAL;
+	if (hf->ring)
+		return -EBUSY;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	rx_offset = PAGE_ALIGN(sizeof(struct ipod_hid_ring_ctl));
+	tx_offset = rx_offset + setup.rx_slots * sizeof(struct ipod_hid_ring_slot);
+	ring->size = PAGE_ALIGN(tx_offset + setup.tx_slots * sizeof(struct ipod_hid_ring_slot));
+	ring->mem = vmalloc_user(ring->size);
+	if (!ring->mem) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	ring->ctl = ring->mem;
+	ring->rx = ring->mem + rx_offset;
+	ring->tx = ring->mem + tx_offset;
+	ring->rx_slots = setup.rx_slots;
+	ring->tx_slots = setup.tx_slots;
+	ring->lane = READ_ONCE(hf->prio);
+	ring->file = hf;
+
+	setup.rx_offset = rx_offset;
+	setup.tx_offset = tx_offset;
+	setup.size = ring->size;
+	if (copy_to_user(argp, &setup, sizeof(setup))) {
+		ret = -EFAULT;
+		goto fail;
+	}
+
+	// one owner per device, and no read() client it would starve
+	mutex_lock(&hid->open_lock);
+	spin_lock_irqsave(&hid->send_lock, flags);
+	if (rcu_access_pointer(hid->ring) || atomic_read(&hid->refcnt) > 1)
+		ret = -EBUSY;
+	else
+		rcu_assign_pointer(hid->ring, ring);
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+	mutex_unlock(&hid->open_lock);
+	if (ret)
+		goto fail;
+
+	hf->ring = ring;
+	return 0;
 
+fail:
+	vfree(ring->mem);
+	kfree(ring);
 	return ret;
 }
 
+static void ipod_hid_ring_release(struct ipod_hid_file *hf)
+{
+	struct ipod_hid *hid = hf->hid;
+	struct ipod_hid_ring *ring = hf->ring;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hid->send_lock, flags);
+	RCU_INIT_POINTER(hid->ring, NULL);
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+	// wait out ipod_hid_ring_rx()
+	synchronize_rcu();
+
+	vfree(ring->mem);
+	kfree(ring);
+	hf->ring = NULL;
+}
+
+static int ipod_hid_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ipod_hid_file *hf = file->private_data;
+	struct ipod_hid_ring *ring = hf->ring;
+
+	if (!ring)
+		return -EINVAL;
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+// rx_lock nests outside send_lock, the auto responder sends from the ep0 completion
+static void ipod_hid_stats_get(struct ipod_hid *hid, struct ipod_hid_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	spin_lock(&hid->send_lock);
+	*stats = hid->stats;
+	spin_unlock(&hid->send_lock);
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+}
+
+static void ipod_hid_stats_reset(struct ipod_hid *hid)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	spin_lock(&hid->send_lock);
+	memset(&hid->stats, 0, sizeof(hid->stats));
+	hid->rx_wake_ns = 0;
+	spin_unlock(&hid->send_lock);
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+}
+
+static void ipod_hid_stats_hist(struct seq_file *m, const char *name, const u64 *hist)
+{
+	unsigned int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < IPOD_HID_STATS_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		seq_printf(m, "  >= %llu ns: %llu\n", i ? 1ULL << (i - 1) : 0ULL, hist[i]);
+	}
+}
+
+static int ipod_hid_stats_show(struct seq_file *m, void *unused)
+{
+	struct ipod_hid *hid = m->private;
+	struct ipod_hid_stats *stats;
+	unsigned int i;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+	ipod_hid_stats_get(hid, stats);
+
+	seq_printf(m, "rx: %llu reports %llu bytes\n", stats->rx_reports, stats->rx_bytes);
+	for (i = 0; i < IPOD_HID_STATS_IDS; i++)
+		if (stats->rx_reports_id[i])
+			seq_printf(m, "  id %u: %llu reports %llu bytes\n", i,
+				stats->rx_reports_id[i], stats->rx_bytes_id[i]);
+	seq_printf(m, "tx: %llu reports %llu bytes\n", stats->tx_reports, stats->tx_bytes);
+	for (i = 0; i < IPOD_HID_STATS_IDS; i++)
+		if (stats->tx_reports_id[i])
+			seq_printf(m, "  id %u: %llu reports %llu bytes\n", i,
+				stats->tx_reports_id[i], stats->tx_bytes_id[i]);
+	seq_printf(m, "rx too long: %llu\n", stats->rx_too_long);
+	seq_printf(m, "rx fifo high water: %u\n", stats->rx_fifo_high_water);
+	seq_printf(m, "tx queue high water: %u/%u\n", stats->tx_queue_high_water,
+		hid->nr_in_req);
+	ipod_hid_stats_hist(m, "write to IN completion", stats->tx_latency);
+	ipod_hid_stats_hist(m, "SET_REPORT to read", stats->rx_latency);
+
+	kfree(stats);
+	return 0;
+}
+
+static int ipod_hid_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ipod_hid_stats_show, inode->i_private);
+}
+
+static const struct file_operations ipod_hid_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ipod_hid_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+// any write resets the counters
+static ssize_t ipod_hid_stats_reset_write(struct file *file, const char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	ipod_hid_stats_reset(file->private_data);
+	return count;
+}
+
+static const struct file_operations ipod_hid_stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = ipod_hid_stats_reset_write,
+	.llseek = noop_llseek,
+};
+
+// pcap file and record headers, in host byte order like the pcap magic
+struct ipod_hid_pcap_hdr {
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	s32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 linktype;
+};
+
+struct ipod_hid_pcap_rec {
+	u32 ts_sec;
+	u32 ts_nsec;
+	u32 incl_len;
+	u32 orig_len;
+};
+
+// what one open of the recorder file reads
+struct ipod_hid_rec_dump {
+	size_t len;
+	u8 data[];
+};
+
+/*
+ * Copy out every record still in the ring, oldest first. Records being
+ * written, or overwritten while we copy, are left out.
+ */
+static int ipod_hid_rec_open(struct inode *inode, struct file *file)
+{
+	struct ipod_hid *hid = inode->i_private;
+	struct ipod_hid_pcap_hdr hdr = {
+		.magic = 0xa1b23c4d,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = IPOD_HID_REC_SNAPLEN,
+		.linktype = IPOD_HID_REC_LINKTYPE,
+	};
+	struct ipod_hid_pcap_rec prec;
+	struct ipod_hid_rec_slot *slot, copy;
+	struct ipod_hid_rec_dump *dump;
+	u32 head, seq, s;
+	u8 *p;
+
+	if (!hid->rec)
+		return -ENODEV;
+
+	dump = vmalloc(sizeof(*dump) + sizeof(hdr) +
+		hid->rec_slots * (sizeof(prec) + IPOD_HID_REC_SNAPLEN));
+	if (!dump)
+		return -ENOMEM;
+	p = dump->data;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+
+	head = atomic_read(&hid->rec_head);
+	seq = head > hid->rec_slots ? head - hid->rec_slots : 0;
+	for (; seq != head; seq++) {
+		slot = &hid->rec[seq & (hid->rec_slots - 1)];
+		s = smp_load_acquire(&slot->seq);
+		if (s != seq + 1)
+			continue;
+		copy = *slot;
+		smp_rmb();
+		if (READ_ONCE(slot->seq) != s || copy.len > IPOD_HID_REC_SNAPLEN)
+			continue;
+
+		prec.ts_sec = div_u64_rem(copy.ts, NSEC_PER_SEC, &prec.ts_nsec);
+		prec.incl_len = copy.len;
+		prec.orig_len = copy.orig_len;
+		memcpy(p, &prec, sizeof(prec));
+		p += sizeof(prec);
+		memcpy(p, copy.data, copy.len);
+		p += copy.len;
+	}
+	dump->len = p - dump->data;
+
+	file->private_data = dump;
+	return 0;
+}
+
+static ssize_t ipod_hid_rec_read(struct file *file, char __user *buf, size_t count,
+	loff_t *ppos)
+{
+	struct ipod_hid_rec_dump *dump = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, dump->data, dump->len);
+}
+
+static int ipod_hid_rec_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations ipod_hid_rec_fops = {
+	.owner = THIS_MODULE,
+	.open = ipod_hid_rec_open,
+	.read = ipod_hid_rec_read,
+	.llseek = default_llseek,
+	.release = ipod_hid_rec_release,
+};
+
+static unsigned int ipod_hid_tx_plan_max(const struct ipod_hid_tx_plan *plan);
+
+static long ipod_hid_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct ipod_hid_file *hf = file->private_data;
+	struct ipod_hid *hid = hf->hid;
+	void __user *argp = (void __user *)arg;
+	struct ipod_hid_packet_stats stats;
+	struct ipod_hid_rx_stats rx_stats;
+	struct ipod_hid_stats *all_stats;
+	struct ipod_hid_auto_entry *entry;
+	struct ipod_hid_link link;
+	unsigned long flags;
+	__u32 val;
+	int ret;
+
+	switch (cmd) {
+	case IPOD_HID_IOC_SET_READ_MODE:
+		if (get_user(val, (__u32 __user *)argp))
+			return -EFAULT;
+		if (val > IPOD_HID_READ_FRAMED)
+			return -EINVAL;
+		WRITE_ONCE(hf->read_mode, val);
+		return 0;
+	case IPOD_HID_IOC_GET_READ_MODE:
+		return put_user(READ_ONCE(hf->read_mode), (__u32 __user *)argp);
+	case IPOD_HID_IOC_RING_SETUP:
+		return ipod_hid_ring_setup(hf, argp);
+	case IPOD_HID_IOC_RING_KICK:
+		if (!hf->ring)
+			return -EINVAL;
+		spin_lock_irqsave(&hid->send_lock, flags);
+		ipod_hid_send_pump(hid);
+		spin_unlock_irqrestore(&hid->send_lock, flags);
+		ipod_hid_rx_resume(hid);
+		return 0;
+	case IPOD_HID_IOC_SET_PACKET_MODE:
+		if (get_user(val, (__u32 __user *)argp))
+			return -EFAULT;
+		if (val & ~(IPOD_HID_PACKET_RX | IPOD_HID_PACKET_TX))
+			return -EINVAL;
+		// a half joined packet doesn't survive a mode switch
+		spin_lock_irqsave(&hid->rx_lock, flags);
+		WRITE_ONCE(hid->packet_mode, val);
+		hid->rx_pkt_active = false;
+		spin_unlock_irqrestore(&hid->rx_lock, flags);
+		return 0;
+	case IPOD_HID_IOC_GET_PACKET_MODE:
+		return put_user(READ_ONCE(hid->packet_mode), (__u32 __user *)argp);
+	case IPOD_HID_IOC_GET_PACKET_STATS:
+		spin_lock_irqsave(&hid->rx_lock, flags);
+		stats = hid->packet_stats;
+		spin_unlock_irqrestore(&hid->rx_lock, flags);
+		if (copy_to_user(argp, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	case IPOD_HID_IOC_AUTO_SET:
+		entry = memdup_user(argp, sizeof(*entry));
+		if (IS_ERR(entry))
+			return PTR_ERR(entry);
+		ret = ipod_hid_auto_check(entry);
+		if (!ret && !hid->auto_table)
+			ret = ipod_hid_auto_table_alloc(hid);
+		if (!ret) {
+			spin_lock_irqsave(&hid->rx_lock, flags);
+			hid->auto_table[entry->slot] = *entry;
+			spin_unlock_irqrestore(&hid->rx_lock, flags);
+		}
+		kfree(entry);
+		return ret;
+	case IPOD_HID_IOC_AUTO_CLEAR:
+		spin_lock_irqsave(&hid->rx_lock, flags);
+		if (hid->auto_table)
+			memset(hid->auto_table, 0,
+				IPOD_HID_AUTO_MAX_ENTRIES * sizeof(*hid->auto_table));
+		spin_unlock_irqrestore(&hid->rx_lock, flags);
+		return 0;
+	case IPOD_HID_IOC_SET_PRIORITY:
+		if (get_user(val, (__u32 __user *)argp))
+			return -EFAULT;
+		if (val >= NR_HID_TX_LANES)
+			return -EINVAL;
+		// write() picks its lane and lock once, no need to wait for it
+		WRITE_ONCE(hf->prio, val);
+		if (hf->ring) {
+			spin_lock_irqsave(&hid->send_lock, flags);
+			hf->ring->lane = val;
+			spin_unlock_irqrestore(&hid->send_lock, flags);
+		}
+		return 0;
+	case IPOD_HID_IOC_GET_PRIORITY:
+		return put_user(READ_ONCE(hf->prio), (__u32 __user *)argp);
+	case IPOD_HID_IOC_SET_RX_FLOW:
+		if (get_user(val, (__u32 __user *)argp))
+			return -EFAULT;
+		if (val > IPOD_HID_RX_DEFER)
+			return -EINVAL;
+		spin_lock_irqsave(&hid->rx_lock, flags);
+		hid->rx_flow = val;
+		spin_unlock_irqrestore(&hid->rx_lock, flags);
+		// switching to drop releases a held back report
+		ipod_hid_rx_resume(hid);
+		return 0;
+	case IPOD_HID_IOC_GET_RX_FLOW:
+		return put_user(READ_ONCE(hid->rx_flow), (__u32 __user *)argp);
+	case IPOD_HID_IOC_GET_RX_STATS:
+		spin_lock_irqsave(&hid->rx_lock, flags);
+		rx_stats = hid->rx_stats;
+		spin_unlock_irqrestore(&hid->rx_lock, flags);
+		rx_stats.fifo_size = kfifo_initialized(&hid->read_fifo)
+			? kfifo_size(&hid->read_fifo) : 0;
+		if (copy_to_user(argp, &rx_stats, sizeof(rx_stats)))
+			return -EFAULT;
+		return 0;
+	case IPOD_HID_IOC_GET_STATS:
+		all_stats = kmalloc(sizeof(*all_stats), GFP_KERNEL);
+		if (!all_stats)
+			return -ENOMEM;
+		ipod_hid_stats_get(hid, all_stats);
+		ret = copy_to_user(argp, all_stats, sizeof(*all_stats)) ? -EFAULT : 0;
+		kfree(all_stats);
+		return ret;
+	case IPOD_HID_IOC_RESET_STATS:
+		ipod_hid_stats_reset(hid);
+		return 0;
+	case IPOD_HID_IOC_GET_LINK:
+		memset(&link, 0, sizeof(link));
+		spin_lock_irqsave(&hid->send_lock, flags);
+		if (hid->in_ep_enabled && hid->tx_plan) {
+			link.speed = hid->speed;
+			link.report_map = hid->tx_plan == hid->tx_plan_hs
+				? IPOD_HID_MAP_HS : IPOD_HID_MAP_FS;
+			link.max_report = ipod_hid_tx_plan_max(hid->tx_plan);
+		}
+		spin_unlock_irqrestore(&hid->send_lock, flags);
+		if (copy_to_user(argp, &link, sizeof(link)))
+			return -EFAULT;
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
 
 
 
+// The receive side only has somewhere to go while the device is open, so its
+// buffers come and go with the first open and the last release.
+static int ipod_hid_rx_alloc(struct ipod_hid *hid)
+{
+	struct kfifo_rec_ptr_2 fifo;
+	unsigned long flags;
+	u8 *read_buf, *rx_pkt;
+	int ret;
 
+	ret = kfifo_alloc(&fifo, hid->rx_buf_size, GFP_KERNEL);
+	if (ret)
+		return ret;
+	read_buf = kmalloc(REPORT_LENGTH, GFP_KERNEL);
+	rx_pkt = kmalloc(REPORT_LENGTH, GFP_KERNEL);
+	if (!read_buf || !rx_pkt) {
+		kfree(rx_pkt);
+		kfree(read_buf);
+		kfifo_free(&fifo);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&hid->read_lock);
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	hid->read_fifo = fifo;
+	hid->read_buf = read_buf;
+	hid->rx_pkt = rx_pkt;
+	hid->rx_pkt_active = false;
+	hid->rx_pkt_len = 0;
+	hid->rx_stats.fifo_high_water = 0;
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+	mutex_unlock(&hid->read_lock);
+	return 0;
+}
+
+static void ipod_hid_rx_free(struct ipod_hid *hid)
+{
+	struct kfifo_rec_ptr_2 fifo;
+	unsigned long flags;
+	u8 *read_buf, *rx_pkt;
+
+	mutex_lock(&hid->read_lock);
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	fifo = hid->read_fifo;
+	read_buf = hid->read_buf;
+	rx_pkt = hid->rx_pkt;
+	memset(&hid->read_fifo, 0, sizeof(hid->read_fifo));
+	hid->read_buf = NULL;
+	hid->rx_pkt = NULL;
+	hid->rx_pkt_active = false;
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+	mutex_unlock(&hid->read_lock);
+
+	kfree(rx_pkt);
+	kfree(read_buf);
+	kfifo_free(&fifo);
+}
 
 static int ipod_hid_dev_open(struct inode *inode, struct file *fd) {
 	int ret;
+	struct ipod_hid_file *hf;
 	struct ipod_hid *hid = 
 		container_of(inode->i_cdev, struct ipod_hid, cdev);
 	pr_info("ipod_hid_dev_open()\n");
 
-	fd->private_data = hid;
+	hf = kzalloc(sizeof(*hf), GFP_KERNEL);
+	if (!hf)
+		return -ENOMEM;
+	hf->hid = hid;
+	hf->read_mode = IPOD_HID_READ_REPORT;
+	fd->private_data = hf;
 
+	mutex_lock(&hid->open_lock);
 	if(atomic_inc_return(&hid->refcnt) == 1) {
+		ret = ipod_hid_rx_alloc(hid);
+		if (ret) {
+			atomic_dec(&hid->refcnt);
+			mutex_unlock(&hid->open_lock);
+			kfree(hf);
+			return ret;
+		}
 		pr_info("activating \n");
 		if(hid->bound) {
 			ret = usb_function_activate(&hid->func);
+			trace_ipod_hid_activate(true, 1, ret);
 			if(ret) {
 				pr_err("activating err=%d \n", ret);
+				atomic_dec(&hid->refcnt);
+				ipod_hid_rx_free(hid);
+				mutex_unlock(&hid->open_lock);
+				kfree(hf);
 				return ret;
 			}
 		}
 		
 	}
-	
+	mutex_unlock(&hid->open_lock);
 
 	return 0;
 }
 
 static int ipod_hid_dev_release(struct inode *inode, struct file *fd) {
 	int ret;
-	struct ipod_hid *hid = fd->private_data;
+	int i;
+	struct ipod_hid_file *hf = fd->private_data;
+	struct ipod_hid *hid = hf->hid;
 	pr_info("ipod_hid_dev_release()\n");
 
+	// mappings hold the file, so userspace is done with the rings here
+	if (hf->ring)
+		ipod_hid_ring_release(hf);
+
+	// a raw report with more-follows and no end would hold the endpoint
+	// forever; write_lock keeps unbind from freeing the pool under us
+	for (i = 0; i < NR_HID_TX_LANES; i++) {
+		mutex_lock(&hid->write_lock[i]);
+		ipod_hid_abort_packet(hid, i, hf);
+		mutex_unlock(&hid->write_lock[i]);
+	}
+
+	mutex_lock(&hid->open_lock);
 	if(atomic_dec_and_test(&hid->refcnt))
 	{
 		pr_info("deactivating=%d \n", hid->bound);
 		if(hid->bound) {
 			ret = usb_function_deactivate(&hid->func);
+			trace_ipod_hid_activate(false, 0, ret);
 			if(ret) {
 				pr_err("deactivating err=%d \n", ret);
 			}
 		}
-		
-
+		ipod_hid_rx_free(hid);
+		// with nowhere to go, a held back SET_REPORT is let through and dropped
+		ipod_hid_rx_resume(hid);
 	}
+	mutex_unlock(&hid->open_lock);
+	kfree(hf);
 	return 0;
 }
 
@@ -302,8 +1912,15 @@ static const struct file_operations ipod_hid_dev_ops = {
 	.open = ipod_hid_dev_open,
 	.release = ipod_hid_dev_release,
 	.write = ipod_hid_dev_write,
-	.read = ipod_hid_dev_read,
+	.read_iter = ipod_hid_dev_read_iter,
 	.poll = ipod_hid_dev_poll,
+	.mmap = ipod_hid_dev_mmap,
+	.unlocked_ioctl = ipod_hid_dev_ioctl,
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+	.compat_ioctl = compat_ptr_ioctl,
+	#else
+	.compat_ioctl = ipod_hid_dev_ioctl,
+	#endif
 };
 
 // usb
@@ -337,7 +1954,14 @@ int ipod_hid_setup(struct usb_function *func, const struct usb_ctrlrequest *ctrl
 	{
 	case USB_REQ_GET_DESCRIPTOR:
 		VDBG(cdev, "get hid descriptor\n");
-		memcpy(req->buf, ipod_hid_report, sizeof(ipod_hid_report));
+		// the report map has to match what config_ep_by_speed picked
+		if (cdev->gadget->speed >= USB_SPEED_HIGH) {
+			length = min_t(int, w_length, sizeof(ipod_hid_report_hs));
+			memcpy(req->buf, ipod_hid_report_hs, length);
+		} else {
+			length = min_t(int, w_length, sizeof(ipod_hid_report));
+			memcpy(req->buf, ipod_hid_report, length);
+		}
 		goto respond;
 		break;
 	case HID_REQ_GET_REPORT:
@@ -345,6 +1969,9 @@ int ipod_hid_setup(struct usb_function *func, const struct usb_ctrlrequest *ctrl
 		goto respond;
 		break;
 	case HID_REQ_SET_REPORT:
+		// no room: leave the data stage unqueued, the UDC NAKs it
+		if (ipod_hid_rx_defer(hid, length))
+			return 0;
 		req->complete = ipod_hid_recv_complete;
         req->context = hid;
 		goto respond;
@@ -377,6 +2004,7 @@ respond:
 int ipod_hid_set_alt(struct usb_function *func, unsigned intf, unsigned alt)
 {
     struct ipod_hid *hid = func_to_ipod_hid(func);
+	unsigned long flags;
 	int ret = 0;
 
 	DBG(func->config->cdev, " = %s() \n", __FUNCTION__);
@@ -385,6 +2013,11 @@ int ipod_hid_set_alt(struct usb_function *func, unsigned intf, unsigned alt)
 			ERROR(func->config->cdev, "%s:%d Error!\n", __func__, __LINE__);
 			return -EINVAL;
 		}
+		spin_lock_irqsave(&hid->send_lock, flags);
+		hid->in_ep_enabled = false;
+		hid->speed = USB_SPEED_UNKNOWN;
+		spin_unlock_irqrestore(&hid->send_lock, flags);
+
 		ret = usb_ep_disable(hid->in_ep);
 		if(ret) {
 			DBG(func->config->cdev, "usb_ep_disable FAILED!\n");
@@ -405,6 +2038,22 @@ int ipod_hid_set_alt(struct usb_function *func, unsigned intf, unsigned alt)
 			return ret;
 		}
 
+		// reports written while the host was away go out now
+		spin_lock_irqsave(&hid->send_lock, flags);
+		WRITE_ONCE(hid->tx_plan,
+			func->config->cdev->gadget->speed >= USB_SPEED_HIGH
+			? hid->tx_plan_hs : hid->tx_plan_fs);
+		// whatever packet was half on the wire went with the old session
+		hid->tx_sent_more = false;
+		hid->in_ep_enabled = true;
+		hid->speed = func->config->cdev->gadget->speed;
+		ipod_hid_send_pump(hid);
+		spin_unlock_irqrestore(&hid->send_lock, flags);
+		// packet writers wait for the plan of the speed the host picked
+		wake_up_interruptible(&hid->write_waitq);
+		ipod_hid_rec_event(hid, IPOD_HID_REC_EV_ENABLE,
+			func->config->cdev->gadget->speed);
+
 		return 0;
 	}
 
@@ -414,15 +2063,205 @@ int ipod_hid_set_alt(struct usb_function *func, unsigned intf, unsigned alt)
 void ipod_hid_disable(struct usb_function *func)
 {
     struct ipod_hid *hid = func_to_ipod_hid(func);
+	unsigned long flags;
 	DBG(func->config->cdev, " = %s() \n", __FUNCTION__);
 
+	spin_lock_irqsave(&hid->send_lock, flags);
+	hid->in_ep_enabled = false;
+	hid->speed = USB_SPEED_UNKNOWN;
+	spin_unlock_irqrestore(&hid->send_lock, flags);
+
 	usb_ep_disable(hid->in_ep);
+	// reset or new config: ep0 belongs to the next control transfer now
+	ipod_hid_rx_defer_cancel(hid);
+	ipod_hid_rec_event(hid, IPOD_HID_REC_EV_DISABLE, 0);
+}
+
+void ipod_hid_suspend(struct usb_function *func)
+{
+	struct ipod_hid *hid = func_to_ipod_hid(func);
+	DBG(func->config->cdev, " = %s() \n", __FUNCTION__);
+
+	// the host stopped the bus, it won't come back for the old transfer
+	ipod_hid_rx_defer_cancel(hid);
+}
+
+static unsigned int ipod_hid_report_trans(unsigned int size, unsigned int maxpacket)
+{
+	// report id + data
+	return DIV_ROUND_UP(1 + size, maxpacket);
+}
+
+/*
+ * Collect the Input reports of a report descriptor and work out how to send
+ * packets over them. Only the short items the iPod descriptors use matter:
+ * Report Size, Report ID, Report Count and Input.
+ */
+static struct ipod_hid_tx_plan *ipod_hid_tx_plan_build(const u8 *desc, size_t len,
+	unsigned int maxpacket)
+{
+	struct ipod_hid_tx_plan *plan;
+	u32 report_size = 0, report_count = 0, report_id = 0, val;
+	unsigned int i, n, r, sz;
+	unsigned int cap, trans, pad;
+	u64 bytes;
+	u8 b;
+
+	// ~12 KB, no need for it to be physically contiguous
+	plan = kvzalloc(sizeof(*plan), GFP_KERNEL);
+	if (!plan)
+		return NULL;
+
+	for (i = 0; i < len; i += 1 + sz) {
+		b = desc[i];
+		if (b == 0xfe) {
+			// long item: size, tag, data
+			if (i + 1 >= len)
+				break;
+			sz = 2 + desc[i + 1];
+			continue;
+		}
+		sz = (b & 3) == 3 ? 4 : b & 3;
+		if (i + sz >= len)
+			break;
+		val = 0;
+		for (n = 0; n < sz; n++)
+			val |= desc[i + 1 + n] << (8 * n);
+
+		switch (b & 0xfc) {
+		case 0x74:
+			report_size = val;
+			break;
+		case 0x84:
+			report_id = val;
+			break;
+		case 0x94:
+			report_count = val;
+			break;
+		case 0x80:
+			// Input, has to hold the link control byte and fit a request
+			bytes = (u64)report_size * report_count / 8;
+			if (bytes < 2 || 1 + bytes > REPORT_LENGTH ||
+				plan->nr_reports == MAX_HID_IN_REPORTS)
+				break;
+			plan->id[plan->nr_reports] = report_id;
+			plan->size[plan->nr_reports++] = bytes;
+			break;
+		}
+	}
+
+	if (!plan->nr_reports) {
+		kvfree(plan);
+		return NULL;
+	}
+
+	// bulk: the most packet bytes per transaction, ties to the bigger report
+	for (r = 1; r < plan->nr_reports; r++) {
+		u64 a = (u64)(plan->size[r] - 1) *
+			ipod_hid_report_trans(plan->size[plan->bulk], maxpacket);
+		u64 c = (u64)(plan->size[plan->bulk] - 1) *
+			ipod_hid_report_trans(plan->size[r], maxpacket);
+		if (a > c || (a == c && plan->size[r] > plan->size[plan->bulk]))
+			plan->bulk = r;
+	}
+
+	// fewest transactions, then least padding
+	for (n = 1; n <= HID_TX_PLAN_WINDOW; n++) {
+		plan->step[n].trans = USHRT_MAX;
+		for (r = 0; r < plan->nr_reports; r++) {
+			cap = plan->size[r] - 1;
+			trans = ipod_hid_report_trans(plan->size[r], maxpacket);
+			if (cap >= n) {
+				pad = cap - n;
+			} else {
+				trans += plan->step[n - cap].trans;
+				pad = plan->step[n - cap].pad;
+			}
+			if (trans < plan->step[n].trans ||
+				(trans == plan->step[n].trans && pad < plan->step[n].pad)) {
+				plan->step[n].trans = trans;
+				plan->step[n].pad = pad;
+				plan->step[n].report = r;
+			}
+		}
+	}
+
+	return plan;
+}
+
+// Longest Input report in the plan, report id included.
+static unsigned int ipod_hid_tx_plan_max(const struct ipod_hid_tx_plan *plan)
+{
+	unsigned int r, len = 0;
+
+	for (r = 0; r < plan->nr_reports; r++)
+		len = max_t(unsigned int, len, 1 + plan->size[r]);
+	return len;
+}
+
+static void ipod_hid_free_tx_plans(struct ipod_hid *hid)
+{
+	hid->tx_plan = NULL;
+	kvfree(hid->tx_plan_fs);
+	kvfree(hid->tx_plan_hs);
+	hid->tx_plan_fs = NULL;
+	hid->tx_plan_hs = NULL;
+}
+
+static void ipod_hid_free_ep0_req(struct ipod_hid *hid, struct usb_gadget *gadget)
+{
+	struct usb_request *req = hid->ep0_req;
+	unsigned long flags;
+	bool queued;
+
+	if (!req)
+		return;
+
+	spin_lock_irqsave(&hid->rx_lock, flags);
+	hid->rx_deferred = false;
+	queued = hid->rx_ep0_queued;
+	spin_unlock_irqrestore(&hid->rx_lock, flags);
+	if (queued)
+		usb_ep_dequeue(gadget->ep0, req);
+
+	kfree(req->buf);
+	usb_ep_free_request(gadget->ep0, req);
+	hid->ep0_req = NULL;
+	hid->rx_ep0_queued = false;
+}
+
+static void ipod_hid_free_in_reqs(struct ipod_hid *hid)
+{
+	int i;
+
+	if (!hid->in_req)
+		return;
+
+	for (i = 0; i < hid->nr_in_req; i++) {
+		if (hid->in_req[i].req) {
+			kfree(hid->in_req[i].req->buf);
+			usb_ep_free_request(hid->in_ep, hid->in_req[i].req);
+		}
+	}
+	kfree(hid->in_req);
+	hid->in_req = NULL;
+	INIT_LIST_HEAD(&hid->in_req_free);
+	hid->in_req_nfree = 0;
+	hid->in_req_inflight = 0;
+	for (i = 0; i < NR_HID_TX_LANES; i++) {
+		INIT_LIST_HEAD(&hid->in_req_pending[i]);
+		hid->tx_more[i] = false;
+		hid->tx_owner[i] = NULL;
+	}
+	hid->tx_sent_more = false;
 }
 
 int ipod_hid_bind(struct usb_configuration *conf, struct usb_function *func)
 {
     struct ipod_hid *hid = func_to_ipod_hid(func);
+	struct usb_request *req;
 	int ret = 0;
+	int i;
 
 	usb_function_deactivate(func);
 
@@ -437,46 +2276,105 @@ int ipod_hid_bind(struct usb_configuration *conf, struct usb_function *func)
 		ERROR(conf->cdev, "usb_ep_autoconfig FAILED\n");
 		return -ENODEV;
 	}
+	ipod_hid_endpoint_hs.bEndpointAddress = ipod_hid_endpoint.bEndpointAddress;
 
 	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
-	ret = usb_assign_descriptors(func, ipod_hid_desc_fs_hs, ipod_hid_desc_fs_hs, NULL, NULL);
+	ret = usb_assign_descriptors(func, ipod_hid_desc_fs, ipod_hid_desc_hs, NULL, NULL);
 	#else
-	ret = usb_assign_descriptors(func, ipod_hid_desc_fs_hs, ipod_hid_desc_fs_hs, NULL);
+	ret = usb_assign_descriptors(func, ipod_hid_desc_fs, ipod_hid_desc_hs, NULL);
 	#endif
 
 	if(ret) {
         return ret;
     }
 
-	hid->in_req = usb_ep_alloc_request(hid->in_ep, GFP_KERNEL);
-	hid->in_req->buf = kmalloc(REPORT_LENGTH, GFP_KERNEL);
+	// the descriptors are fixed, the plans only depend on them
+	hid->tx_plan_fs = ipod_hid_tx_plan_build(ipod_hid_report, sizeof(ipod_hid_report),
+		usb_endpoint_maxp(&ipod_hid_endpoint));
+	hid->tx_plan_hs = ipod_hid_tx_plan_build(ipod_hid_report_hs, sizeof(ipod_hid_report_hs),
+		usb_endpoint_maxp(&ipod_hid_endpoint_hs));
+	if (!hid->tx_plan_fs || !hid->tx_plan_hs) {
+		ret = -ENOMEM;
+		goto fail;
+	}
 
-	
-	
+	// no IN report is longer than the biggest one either speed declares
+	hid->in_req_len = max(ipod_hid_tx_plan_max(hid->tx_plan_fs),
+		ipod_hid_tx_plan_max(hid->tx_plan_hs));
+	hid->in_req = kcalloc(hid->nr_in_req, sizeof(*hid->in_req), GFP_KERNEL);
+	if (!hid->in_req) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < hid->nr_in_req; i++) {
+		req = usb_ep_alloc_request(hid->in_ep, GFP_KERNEL);
+		if (!req) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		hid->in_req[i].req = req;
+		hid->in_req[i].hid = hid;
+		req->context = &hid->in_req[i];
+		req->buf = kmalloc(hid->in_req_len, GFP_KERNEL);
+		if (!req->buf) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		ipod_hid_give_free(hid, req);
+	}
+
+	hid->ep0_req = usb_ep_alloc_request(conf->cdev->gadget->ep0, GFP_KERNEL);
+	if (!hid->ep0_req) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	hid->ep0_req->buf = kmalloc(REPORT_LENGTH, GFP_KERNEL);
+	if (!hid->ep0_req->buf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
 
 	
 	if(atomic_read(&hid->refcnt) > 0) {
-		usb_function_activate(&hid->func);
+		ret = usb_function_activate(&hid->func);
+		trace_ipod_hid_activate(true, atomic_read(&hid->refcnt), ret);
+		ret = 0;
 	}
 	hid->bound = true;
+	wake_up_interruptible(&hid->write_waitq);
+
+	return ret;
 
+fail:
+	ipod_hid_free_ep0_req(hid, conf->cdev->gadget);
+	ipod_hid_free_tx_plans(hid);
+	ipod_hid_free_in_reqs(hid);
 	return ret;
 }
 
 void ipod_hid_unbind(struct usb_configuration *conf, struct usb_function *func)
 {
     struct ipod_hid *hid = func_to_ipod_hid(func);
+	int ret;
 	DBG(conf->cdev, " = %s(), deactivs=%d\n", __FUNCTION__, conf->cdev->deactivations);
-	hid->bound = false;
+	WRITE_ONCE(hid->bound, false);
 
 	
 
 	if(atomic_read(&hid->refcnt) > 0) {
-		usb_function_deactivate(&hid->func);
+		ret = usb_function_deactivate(&hid->func);
+		trace_ipod_hid_activate(false, atomic_read(&hid->refcnt), ret);
 	}
 
-	kfree(hid->in_req->buf);
-	usb_ep_free_request(hid->in_ep, hid->in_req);
+	// a writer may be filling a request from the pool
+	wake_up_interruptible(&hid->write_waitq);
+	mutex_lock(&hid->write_lock[IPOD_HID_PRIO_BULK]);
+	mutex_lock(&hid->write_lock[IPOD_HID_PRIO_HIGH]);
+	ipod_hid_free_in_reqs(hid);
+	ipod_hid_free_tx_plans(hid);
+	mutex_unlock(&hid->write_lock[IPOD_HID_PRIO_HIGH]);
+	mutex_unlock(&hid->write_lock[IPOD_HID_PRIO_BULK]);
+	ipod_hid_free_ep0_req(hid, conf->cdev->gadget);
 	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
 	usb_ep_autoconfig_release(hid->in_ep);
 	#endif
@@ -496,17 +2394,31 @@ void ipod_hid_unbind(struct usb_configuration *conf, struct usb_function *func)
 struct ipod_hid_opts {
 	struct usb_function_instance	fi;
 	dev_t dev;
+	struct mutex lock;
+	int refcnt;
+	unsigned int rx_buf_size;
+	unsigned int tx_reqs;
+	unsigned int recorder_slots;
 };
 
 
 static void ipod_hid_free(struct usb_function *func) 
 {
     struct ipod_hid *hid = func_to_ipod_hid(func);
+	struct ipod_hid_opts *opts
+		= container_of(func->fi, struct ipod_hid_opts, fi);
 	pr_info("ipod_hid_free()\n");
 
+	debugfs_remove_recursive(hid->debugfs);
 	device_destroy(ipod_hid_class, MKDEV(hid->major, 0));
 	cdev_del(&hid->cdev);
 
+	mutex_lock(&opts->lock);
+	opts->refcnt--;
+	mutex_unlock(&opts->lock);
+
+	kfree(hid->auto_table);
+	vfree(hid->rec);
     kfree(hid);
 }
 
@@ -532,6 +2444,7 @@ static struct usb_function *ipod_hid_alloc(struct usb_function_instance *fi)
     hid->func.set_alt = ipod_hid_set_alt;
     hid->func.setup = ipod_hid_setup;
     hid->func.disable = ipod_hid_disable;
+    hid->func.suspend = ipod_hid_suspend;
     hid->func.free_func = ipod_hid_free;
 	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
     hid->func.req_match = ipod_hid_req_match;
@@ -539,16 +2452,36 @@ static struct usb_function *ipod_hid_alloc(struct usb_function_instance *fi)
 	hid->major = MAJOR(opts->dev);
 	//hid->func.bind_deactivated = false;
 
-	mutex_init(&hid->lock);
-	atomic_set(&hid->refcnt, 0);
-	init_waitqueue_head(&hid->waitq);
+	mutex_lock(&opts->lock);
+	opts->refcnt++;
+	hid->rx_buf_size = opts->rx_buf_size;
+	hid->nr_in_req = opts->tx_reqs;
+	hid->rec_slots = opts->recorder_slots;
+	mutex_unlock(&opts->lock);
+
+	// the recorder is a debugging aid, go on without it
+	if (hid->rec_slots) {
+		hid->rec_slots = roundup_pow_of_two(hid->rec_slots);
+		hid->rec = vzalloc(hid->rec_slots * sizeof(*hid->rec));
+		if (!hid->rec)
+			pr_warn("no memory for %u recorder slots\n", hid->rec_slots);
+	}
+	atomic_set(&hid->rec_head, 0);
 
-	INIT_KFIFO(hid->read_fifo);
+	mutex_init(&hid->read_lock);
+	mutex_init(&hid->open_lock);
+	mutex_init(&hid->write_lock[IPOD_HID_PRIO_BULK]);
+	mutex_init(&hid->write_lock[IPOD_HID_PRIO_HIGH]);
+	atomic_set(&hid->refcnt, 0);
+	init_waitqueue_head(&hid->read_waitq);
+	init_waitqueue_head(&hid->write_waitq);
 
+	spin_lock_init(&hid->rx_lock);
 
-	INIT_KFIFO(hid->write_fifo);
-	INIT_WORK(&hid->send_work, ipod_hid_send_workfn);
-	init_completion(&hid->send_completion);	
+	spin_lock_init(&hid->send_lock);
+	INIT_LIST_HEAD(&hid->in_req_free);
+	INIT_LIST_HEAD(&hid->in_req_pending[IPOD_HID_PRIO_BULK]);
+	INIT_LIST_HEAD(&hid->in_req_pending[IPOD_HID_PRIO_HIGH]);
 
 	
 
@@ -564,7 +2497,18 @@ static struct usb_function *ipod_hid_alloc(struct usb_function_instance *fi)
 	if(IS_ERR(device)) {
 		return ERR_PTR(-EINVAL);
 	}
-	
+
+	if (ipod_hid_debugfs_root) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "iap%d", MINOR(dev));
+		hid->debugfs = debugfs_create_dir(name, ipod_hid_debugfs_root);
+		debugfs_create_file("stats", 0444, hid->debugfs, hid, &ipod_hid_stats_fops);
+		debugfs_create_file("reset", 0200, hid->debugfs, hid,
+			&ipod_hid_stats_reset_fops);
+		debugfs_create_file("recorder", 0400, hid->debugfs, hid,
+			&ipod_hid_rec_fops);
+	}
 
 
 
@@ -586,9 +2530,76 @@ static struct configfs_item_operations ipod_item_ops = {
 	.release	= ipod_attr_release,
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+#define IPOD_HID_OPTS_ATTR(name, min, max)						\
+static ssize_t ipod_hid_opts_##name##_show(struct config_item *item,		\
+					   char *page)				\
+{										\
+	struct ipod_hid_opts *opts = container_of(to_config_group(item),	\
+		struct ipod_hid_opts, fi.group);				\
+	int result;								\
+										\
+	mutex_lock(&opts->lock);						\
+	result = sprintf(page, "%u\n", opts->name);				\
+	mutex_unlock(&opts->lock);						\
+										\
+	return result;								\
+}										\
+										\
+static ssize_t ipod_hid_opts_##name##_store(struct config_item *item,		\
+					    const char *page, size_t len)	\
+{										\
+	struct ipod_hid_opts *opts = container_of(to_config_group(item),	\
+		struct ipod_hid_opts, fi.group);				\
+	unsigned int num;							\
+	int ret;								\
+										\
+	mutex_lock(&opts->lock);						\
+	if (opts->refcnt) {							\
+		ret = -EBUSY;							\
+		goto end;							\
+	}									\
+										\
+	ret = kstrtouint(page, 0, &num);					\
+	if (ret)								\
+		goto end;							\
+										\
+	if (num < min || num > max) {						\
+		ret = -EINVAL;							\
+		goto end;							\
+	}									\
+										\
+	opts->name = num;							\
+	ret = len;								\
+										\
+end:										\
+	mutex_unlock(&opts->lock);						\
+	return ret;								\
+}										\
+										\
+CONFIGFS_ATTR(ipod_hid_opts_, name)
+
+// bytes of SET_REPORT data held for read() while the device is open
+IPOD_HID_OPTS_ATTR(rx_buf_size, MIN_HID_RX_BUF_SIZE, MAX_HID_RX_BUF_SIZE);
+// IN requests, shared by both write priorities
+IPOD_HID_OPTS_ATTR(tx_reqs, MIN_HID_IN_TRANSFERS, MAX_HID_IN_TRANSFERS);
+// flight recorder records, rounded up to a power of two, 0 turns it off
+IPOD_HID_OPTS_ATTR(recorder_slots, 0, MAX_HID_REC_SLOTS);
+
+static struct configfs_attribute *ipod_hid_attrs[] = {
+	&ipod_hid_opts_attr_rx_buf_size,
+	&ipod_hid_opts_attr_tx_reqs,
+	&ipod_hid_opts_attr_recorder_slots,
+	NULL,
+};
+#endif
+
 static struct config_item_type ipod_hid_func_type = {
 	.ct_owner	 = THIS_MODULE,
     .ct_item_ops = &ipod_item_ops,
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	.ct_attrs	= ipod_hid_attrs,
+	#endif
 };
 
 static void ipod_hid_free_inst(struct usb_function_instance *fi)
@@ -616,6 +2627,11 @@ static struct usb_function_instance *ipod_hid_alloc_inst(void)
 		MAJOR(opts->dev), MINOR(opts->dev));
 	
 
+	mutex_init(&opts->lock);
+	opts->rx_buf_size = HID_RX_BUF_SIZE;
+	opts->tx_reqs = NUM_HID_IN_TRANSFERS;
+	opts->recorder_slots = HID_REC_SLOTS;
+
 	opts->fi.free_func_inst = ipod_hid_free_inst;
 	config_group_init_type_name(&opts->fi.group, "", &ipod_hid_func_type);
 	
@@ -641,7 +2657,10 @@ static int __init ipod_hid_mod_init(void)
 	}	
 #endif
 
-
+	// stats are optional, carry on without them
+	ipod_hid_debugfs_root = debugfs_create_dir("ipod_hid", NULL);
+	if (IS_ERR(ipod_hid_debugfs_root))
+		ipod_hid_debugfs_root = NULL;
 
 
 	return usb_function_register(&ipod_hidusb_func);
@@ -650,6 +2669,7 @@ static void __exit ipod_hid_mod_exit(void)
 {
 	class_destroy(ipod_hid_class);
 	usb_function_unregister(&ipod_hidusb_func);
+	debugfs_remove_recursive(ipod_hid_debugfs_root);
 }
 
 module_init(ipod_hid_mod_init);
@@ -0,0 +1,261 @@
+#ifndef __IPOD_HID_H
+#define __IPOD_HID_H
+
+/*
+ * /dev/iapN ioctl interface, shared with the userspace client.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define IPOD_HID_IOC_MAGIC 'i'
+
+// read() modes, per open file
+// one report per read(), the buffer has to hold the whole report (default)
+#define IPOD_HID_READ_REPORT	0
+// as many reports as fit, each one prefixed with its length as a native
+// endian __u16, back to back with no padding
+#define IPOD_HID_READ_FRAMED	1
+
+#define IPOD_HID_IOC_SET_READ_MODE	_IOW(IPOD_HID_IOC_MAGIC, 1, __u32)
+#define IPOD_HID_IOC_GET_READ_MODE	_IOR(IPOD_HID_IOC_MAGIC, 2, __u32)
+
+/*
+ * Shared memory rings. IPOD_HID_IOC_RING_SETUP allocates an RX and a TX ring
+ * for the calling file, which then mmap()s ipod_hid_ring_setup.size bytes at
+ * offset 0:
+ *
+ *   0          struct ipod_hid_ring_ctl
+ *   rx_offset  rx_slots * struct ipod_hid_ring_slot
+ *   tx_offset  tx_slots * struct ipod_hid_ring_slot
+ *
+ * Indices run freely and wrap at 2^32; the slot is index & (slots - 1). The
+ * producer fills a slot, then stores head with release semantics; the
+ * consumer loads head with acquire semantics, uses the slot and stores tail.
+ * The kernel produces RX (SET_REPORT payloads, instead of read()) and
+ * consumes TX (IN reports, next to write()). TX is picked up whenever an IN
+ * transfer completes, so a busy link needs no syscalls; after posting into
+ * an idle link ring the doorbell with IPOD_HID_IOC_RING_KICK or poll().
+ *
+ * The RX ring takes every SET_REPORT, so setup fails with EBUSY while any
+ * other file has the device open. Files opened later can still write, but
+ * read() on them fails with EBUSY until the ring owner closes.
+ */
+#define IPOD_HID_RING_SLOT_SIZE	1024
+#define IPOD_HID_RING_MAX_SLOTS	256
+
+struct ipod_hid_ring_slot {
+	__u32 len;
+	__u8 data[IPOD_HID_RING_SLOT_SIZE - sizeof(__u32)];
+};
+
+// producer and consumer index, each on a cache line of its own so the side
+// polling one doesn't keep stealing the line the other side writes
+struct ipod_hid_ring_idx {
+	__u32 head;
+	__u32 pad0[15];
+	__u32 tail;
+	__u32 pad1[15];
+};
+
+struct ipod_hid_ring_ctl {
+	struct ipod_hid_ring_idx rx;
+	struct ipod_hid_ring_idx tx;
+};
+
+struct ipod_hid_ring_setup {
+	// in: powers of two, up to IPOD_HID_RING_MAX_SLOTS
+	__u32 rx_slots;
+	__u32 tx_slots;
+	// out
+	__u32 rx_offset;
+	__u32 tx_offset;
+	__u32 size;
+};
+
+#define IPOD_HID_IOC_RING_SETUP	_IOWR(IPOD_HID_IOC_MAGIC, 3, struct ipod_hid_ring_setup)
+#define IPOD_HID_IOC_RING_KICK	_IO(IPOD_HID_IOC_MAGIC, 4)
+
+/*
+ * Packet mode, for the whole device. With IPOD_HID_PACKET_RX set the kernel
+ * strips the report ID and link control bytes, joins the fragments of each
+ * iAP packet, checks its checksum and hands out complete packets (0x55,
+ * length, lingo, command, payload, checksum) as single reads or RX ring
+ * slots. Malformed packets are dropped and counted.
+ */
+#define IPOD_HID_PACKET_RX	(1 << 0)
+/*
+ * With IPOD_HID_PACKET_TX every write() is one complete iAP packet, which the
+ * kernel splits over IN reports. Report IDs are picked from the active report
+ * descriptor for the fewest interrupt transactions, then the least padding.
+ * Once the first fragment is queued the rest of the packet is sent even on
+ * O_NONBLOCK files; only a fatal signal or an unbind cuts it short.
+ */
+#define IPOD_HID_PACKET_TX	(1 << 1)
+
+struct ipod_hid_packet_stats {
+	__u64 rx_packets;
+	// no 0x55 or a length that doesn't fit what was received
+	__u64 rx_bad_header;
+	__u64 rx_bad_checksum;
+	// a continuation without a first fragment, or a first fragment
+	// cutting into an unfinished packet
+	__u64 rx_bad_sequence;
+	__u64 rx_oversize;
+	// answered by the auto responder instead of being read
+	__u64 rx_auto_answered;
+};
+
+#define IPOD_HID_IOC_SET_PACKET_MODE	_IOW(IPOD_HID_IOC_MAGIC, 5, __u32)
+#define IPOD_HID_IOC_GET_PACKET_MODE	_IOR(IPOD_HID_IOC_MAGIC, 6, __u32)
+#define IPOD_HID_IOC_GET_PACKET_STATS	_IOR(IPOD_HID_IOC_MAGIC, 7, struct ipod_hid_packet_stats)
+
+/*
+ * Auto responder. Complete incoming packets (always in IPOD_HID_PACKET_RX
+ * mode, single report packets otherwise) are looked up by lingo and command
+ * ID, 16 bit for lingo 0x04, and optionally by the first payload bytes. On a
+ * hit the kernel sends the entry's response as is, and the packet never
+ * reaches read(). A miss, or no idle IN request, leaves the packet to
+ * userspace. With IPOD_HID_AUTO_ECHO_TRANS the two bytes after the command
+ * ID are treated as a transaction ID: match starts after them, and they are
+ * copied into the response at the same place. The kernel fills in the
+ * response checksum.
+ */
+#define IPOD_HID_AUTO_MAX_ENTRIES	16
+#define IPOD_HID_AUTO_MAX_MATCH		16
+#define IPOD_HID_AUTO_MAX_RESPONSE	256
+
+#define IPOD_HID_AUTO_ECHO_TRANS	(1 << 0)
+
+struct ipod_hid_auto_entry {
+	// 0 to IPOD_HID_AUTO_MAX_ENTRIES - 1
+	__u32 slot;
+	__u32 flags;
+	__u8 lingo;
+	__u8 reserved;
+	__u16 cmd;
+	__u16 match_len;
+	// a complete packet starting with 0x55, 0 clears the slot
+	__u16 response_len;
+	__u8 match[IPOD_HID_AUTO_MAX_MATCH];
+	__u8 response[IPOD_HID_AUTO_MAX_RESPONSE];
+};
+
+#define IPOD_HID_IOC_AUTO_SET		_IOW(IPOD_HID_IOC_MAGIC, 8, struct ipod_hid_auto_entry)
+#define IPOD_HID_IOC_AUTO_CLEAR		_IO(IPOD_HID_IOC_MAGIC, 9)
+
+/*
+ * TX priority, per open file (and for the TX ring of that file). Reports
+ * written on an IPOD_HID_PRIO_HIGH file go out before any queued bulk
+ * reports, as soon as the iAP packet on the wire is complete. A few idle IN
+ * requests are kept back for high priority writers, and auto responder
+ * answers go out at high priority too. Open a second file for acks and
+ * status replies while a bulk transfer is running on the first.
+ */
+#define IPOD_HID_PRIO_BULK	0
+#define IPOD_HID_PRIO_HIGH	1
+
+#define IPOD_HID_IOC_SET_PRIORITY	_IOW(IPOD_HID_IOC_MAGIC, 10, __u32)
+#define IPOD_HID_IOC_GET_PRIORITY	_IOR(IPOD_HID_IOC_MAGIC, 11, __u32)
+
+/*
+ * What happens to a SET_REPORT when the read fifo (or RX ring) is full. The
+ * default drops it. IPOD_HID_RX_DEFER holds the data stage back, the UDC
+ * NAKs it, until the reader makes room; a ring reader has to poll() or
+ * IPOD_HID_IOC_RING_KICK after freeing slots. Some hosts give up on a
+ * control transfer long before the 5 s USB 2.0 limit, so a report is held
+ * back for at most 500 ms and never across a bus reset or suspend; after
+ * that it is lost and counted as expired.
+ */
+#define IPOD_HID_RX_DROP	0
+#define IPOD_HID_RX_DEFER	1
+
+struct ipod_hid_rx_stats {
+	// reports (packets in packet mode) lost to a full fifo or ring
+	__u64 dropped;
+	__u64 deferred;
+	__u64 expired;
+	// most bytes ever queued in the read fifo, records headers included
+	__u32 fifo_high_water;
+	__u32 fifo_size;
+};
+
+#define IPOD_HID_IOC_SET_RX_FLOW	_IOW(IPOD_HID_IOC_MAGIC, 12, __u32)
+#define IPOD_HID_IOC_GET_RX_FLOW	_IOR(IPOD_HID_IOC_MAGIC, 13, __u32)
+#define IPOD_HID_IOC_GET_RX_STATS	_IOR(IPOD_HID_IOC_MAGIC, 14, struct ipod_hid_rx_stats)
+
+/*
+ * Transport statistics since bind or the last IPOD_HID_IOC_RESET_STATS,
+ * also in debugfs as ipod_hid/iapN/stats. Per report id counters only
+ * cover ids below IPOD_HID_STATS_IDS, the totals cover all of them. That is
+ * every id of both report maps, the high speed one goes up to 0x15.
+ *
+ * Histograms are log2 of nanoseconds: bucket 0 counts 0, bucket i counts
+ * [2^(i-1), 2^i), the last bucket everything from there up.
+ */
+#define IPOD_HID_STATS_IDS	32
+#define IPOD_HID_STATS_BUCKETS	32
+
+struct ipod_hid_stats {
+	// SET_REPORTs received and IN reports the host took, report ids included
+	__u64 rx_reports;
+	__u64 rx_bytes;
+	__u64 tx_reports;
+	__u64 tx_bytes;
+	__u64 rx_reports_id[IPOD_HID_STATS_IDS];
+	__u64 rx_bytes_id[IPOD_HID_STATS_IDS];
+	__u64 tx_reports_id[IPOD_HID_STATS_IDS];
+	__u64 tx_bytes_id[IPOD_HID_STATS_IDS];
+	// most bytes in the read fifo, most IN requests queued or in flight
+	__u32 rx_fifo_high_water;
+	__u32 tx_queue_high_water;
+	// a report queued by write() until its IN transfer completed
+	__u64 tx_latency[IPOD_HID_STATS_BUCKETS];
+	// a SET_REPORT landing in an empty read fifo until read() returned it
+	__u64 rx_latency[IPOD_HID_STATS_BUCKETS];
+	// reports (packets in packet mode) too long for a ring slot or read()
+	__u64 rx_too_long;
+};
+
+#define IPOD_HID_IOC_GET_STATS	_IOR(IPOD_HID_IOC_MAGIC, 15, struct ipod_hid_stats)
+#define IPOD_HID_IOC_RESET_STATS	_IO(IPOD_HID_IOC_MAGIC, 16)
+
+/*
+ * The link the host enumerated, all zero while it hasn't selected the
+ * interface. speed is an enum usb_device_speed (2 full, 3 high) and decides
+ * which report map the host got: the small full speed one, or the one a
+ * real iPod uses at high speed with IN reports up to 767 bytes.
+ */
+#define IPOD_HID_MAP_NONE	0
+#define IPOD_HID_MAP_FS		1
+#define IPOD_HID_MAP_HS		2
+
+struct ipod_hid_link {
+	__u32 speed;
+	__u32 report_map;
+	// longest Input report of that map, report id included
+	__u32 max_report;
+};
+
+#define IPOD_HID_IOC_GET_LINK	_IOR(IPOD_HID_IOC_MAGIC, 17, struct ipod_hid_link)
+
+/*
+ * Flight recorder, debugfs ipod_hid/iapN/recorder. Opening it takes a
+ * snapshot of the last recorder_slots (configfs) records as a pcap file:
+ * nanosecond timestamps (magic 0xa1b23c4d), wall clock, link type
+ * LINKTYPE_USER0. Every packet is one IPOD_HID_REC_* direction byte, then
+ * the HID report with its id, cut at IPOD_HID_REC_SNAPLEN bytes in all;
+ * the pcap orig_len keeps the full length. IPOD_HID_REC_EVENT packets carry
+ * an IPOD_HID_REC_EV_* code and one argument byte instead of a report.
+ */
+#define IPOD_HID_REC_LINKTYPE	147
+#define IPOD_HID_REC_SNAPLEN	240
+
+#define IPOD_HID_REC_RX		0	// SET_REPORT from the host
+#define IPOD_HID_REC_TX		1	// IN report the host took
+#define IPOD_HID_REC_EVENT	2
+
+#define IPOD_HID_REC_EV_ENABLE	1	// host selected the interface, argument: enum usb_device_speed
+#define IPOD_HID_REC_EV_DISABLE	2	// function disabled (reset, disconnect, reconfigure)
+
+#endif /* __IPOD_HID_H */
@@ -0,0 +1,173 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ipod_hid
+
+#if !defined(__IPOD_HID_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __IPOD_HID_TRACE_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+#include <linux/usb/gadget.h>
+
+// SET_REPORT data stage, first byte is the report id
+TRACE_EVENT(ipod_hid_rx_report,
+
+	TP_PROTO(struct usb_request *req),
+	TP_ARGS(req),
+
+	TP_STRUCT__entry(
+			__field(    u8,    id    )
+			__field(    unsigned int,    length    )
+			__field(    unsigned int,    actual    )
+			__field(     				 int,    status    )
+	),
+
+	TP_fast_assign(
+			__entry->id = req->actual ? ((u8 *)req->buf)[0] : 0;
+			__entry->length = req->length;
+			__entry->actual = req->actual;
+			__entry->status = req->status;
+	),
+
+	TP_printk("id:%u %u/%u status:%d", __entry->id, __entry->actual,
+		__entry->length, __entry->status)
+);
+
+// a report or packet queued for read(), ring true for the mmap ring
+TRACE_EVENT(ipod_hid_rx_queue,
+
+	TP_PROTO(unsigned int len, bool ring, unsigned int used, unsigned int size, bool dropped),
+	TP_ARGS(len, ring, used, size, dropped),
+
+	TP_STRUCT__entry(
+			__field(    unsigned int,    len    )
+			__field(    bool,    ring    )
+			__field(    unsigned int,    used    )
+			__field(    unsigned int,    size    )
+			__field(    bool,    dropped    )
+	),
+
+	TP_fast_assign(
+			__entry->len = len;
+			__entry->ring = ring;
+			__entry->used = used;
+			__entry->size = size;
+			__entry->dropped = dropped;
+	),
+
+	TP_printk("len:%u %s:%u/%u%s", __entry->len,
+		__entry->ring ? "ring" : "fifo", __entry->used, __entry->size,
+		__entry->dropped ? " dropped" : "")
+);
+
+TRACE_EVENT(ipod_hid_read,
+
+	TP_PROTO(size_t count, ssize_t ret, unsigned int fifo_used),
+	TP_ARGS(count, ret, fifo_used),
+
+	TP_STRUCT__entry(
+			__field(    size_t,    count    )
+			__field(    ssize_t,    ret    )
+			__field(    unsigned int,    fifo_used    )
+	),
+
+	TP_fast_assign(
+			__entry->count = count;
+			__entry->ret = ret;
+			__entry->fifo_used = fifo_used;
+	),
+
+	TP_printk("count:%zu ret:%zd fifo:%u", __entry->count, __entry->ret,
+		__entry->fifo_used)
+);
+
+TRACE_EVENT(ipod_hid_write,
+
+	TP_PROTO(size_t count, unsigned int lane, bool packet),
+	TP_ARGS(count, lane, packet),
+
+	TP_STRUCT__entry(
+			__field(    size_t,    count    )
+			__field(    unsigned int,    lane    )
+			__field(    bool,    packet    )
+	),
+
+	TP_fast_assign(
+			__entry->count = count;
+			__entry->lane = lane;
+			__entry->packet = packet;
+	),
+
+	TP_printk("count:%zu lane:%u%s", __entry->count, __entry->lane,
+		__entry->packet ? " packet" : "")
+);
+
+DECLARE_EVENT_CLASS(ipod_hid_tx,
+
+	TP_PROTO(struct usb_request *req, unsigned int inflight, unsigned int nfree),
+	TP_ARGS(req, inflight, nfree),
+
+	TP_STRUCT__entry(
+			__field(    			void *,    ptr    )
+			__field(    u8,    id    )
+			__field(    u8,    link    )
+			__field(    unsigned int,    length    )
+			__field(     				 int,    status    )
+			__field(    unsigned int,    inflight    )
+			__field(    unsigned int,    nfree    )
+	),
+
+	TP_fast_assign(
+			__entry->ptr = req;
+			__entry->id = req->length ? ((u8 *)req->buf)[0] : 0;
+			__entry->link = req->length > 1 ? ((u8 *)req->buf)[1] : 0;
+			__entry->length = req->length;
+			__entry->status = req->status;
+			__entry->inflight = inflight;
+			__entry->nfree = nfree;
+	),
+
+	TP_printk("%p id:%u link:%#x len:%u status:%d inflight:%u free:%u",
+		__entry->ptr, __entry->id, __entry->link, __entry->length,
+		__entry->status, __entry->inflight, __entry->nfree)
+);
+
+// IN report handed to the UDC
+DEFINE_EVENT(ipod_hid_tx, ipod_hid_tx_report,
+	TP_PROTO(struct usb_request *req, unsigned int inflight, unsigned int nfree),
+	TP_ARGS(req, inflight, nfree)
+);
+
+// IN report given back
+DEFINE_EVENT(ipod_hid_tx, ipod_hid_tx_done,
+	TP_PROTO(struct usb_request *req, unsigned int inflight, unsigned int nfree),
+	TP_ARGS(req, inflight, nfree)
+);
+
+// usb_function_activate() (active) or usb_function_deactivate()
+TRACE_EVENT(ipod_hid_activate,
+
+	TP_PROTO(bool active, int refcnt, int ret),
+	TP_ARGS(active, refcnt, ret),
+
+	TP_STRUCT__entry(
+			__field(    bool,    active    )
+			__field(     				 int,    refcnt    )
+			__field(     				 int,    ret    )
+	),
+
+	TP_fast_assign(
+			__entry->active = active;
+			__entry->refcnt = refcnt;
+			__entry->ret = ret;
+	),
+
+	TP_printk("%s refcnt:%d ret:%d", __entry->active ? "activate" : "deactivate",
+		__entry->refcnt, __entry->ret)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE ipod_hid_trace
+#include <trace/define_trace.h>